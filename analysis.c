@@ -0,0 +1,96 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "model.h"
+#include "support.h"
+#include "analysis.h"
+#include "devicedata.h"
+
+int num_analyses=0;
+struct analysis analyses[MAX_ANALYSES];
+
+char *analysis_partials=NULL;
+size_t analysis_partials_size=0;
+
+int analysis_register(const struct analysis *a) {
+	if (num_analyses==MAX_ANALYSES) {
+		printf("too many analyses, cannot register %s\n",a->name);
+		exit(-1);
+	}
+	analyses[num_analyses]=*a;
+	if (analyses[num_analyses].period<1) analyses[num_analyses].period=1;
+	return num_analyses++;
+}
+
+int analysis_due(int id, int iteration) {
+	return iteration%analyses[id].period==0;
+}
+
+// analyses due in the current traversal
+int num_due=0;
+int due[MAX_ANALYSES];
+size_t due_offset[MAX_ANALYSES];
+
+int analysis_begin(int iteration) {
+	//returns whether any analysis is due in this iteration
+	int num_blocks=(NumInsects+ANALYSIS_BLOCK-1)/ANALYSIS_BLOCK;
+	//partials of the due analyses, one after the other, each num_blocks long
+	size_t size=0;
+	num_due=0;
+	for (int k=0;k<num_analyses;k++) {
+		if (!analysis_due(k,iteration)) continue;
+		due[num_due]=k;
+		due_offset[num_due]=size;
+		size+=num_blocks*analyses[k].partial_size;
+		num_due++;
+	}
+	if (num_due==0) return 0;
+	if (size>analysis_partials_size) {
+		analysis_partials=mem_realloc(MEM_ANALYSIS,analysis_partials,size);
+		analysis_partials_size=size;
+	}
+	memset(analysis_partials,0,size);
+	for (int d=0;d<num_due;d++) {
+		struct analysis *a=&analyses[due[d]];
+		if (a->begin) a->begin(a->state,iteration);
+	}
+	return 1;
+}
+
+void analysis_visit_block(int iteration, int block) {
+	struct analysis_view v;
+	v.iteration=iteration;
+	v.begin=block*ANALYSIS_BLOCK;
+	v.end=MIN(NumInsects,v.begin+ANALYSIS_BLOCK);
+	v.insects=insects;
+	v.actions=actions;
+	v.enemy_actions=enemy_actions;
+	v.slow_actions=slow_actions;
+	v.slow_weight=slow_force_weight();
+	v.leaders=leaders;
+	v.num_leaders=NumLeaders;
+	for (int d=0;d<num_due;d++) {
+		struct analysis *a=&analyses[due[d]];
+		if (device_data_active && a->visit_device) continue;
+		a->visit_block(a->state,analysis_partials+due_offset[d]+block*a->partial_size,&v);
+	}
+}
+
+void analysis_visit_device(int iteration) {
+	//the due analyses that visit all blocks on the offload target at once
+	int num_blocks=(NumInsects+ANALYSIS_BLOCK-1)/ANALYSIS_BLOCK;
+	for (int d=0;d<num_due;d++) {
+		struct analysis *a=&analyses[due[d]];
+		if (a->visit_device)
+			a->visit_device(a->state,analysis_partials+due_offset[d],num_blocks);
+	}
+}
+
+void analysis_end(int iteration) {
+	int num_blocks=(NumInsects+ANALYSIS_BLOCK-1)/ANALYSIS_BLOCK;
+	for (int d=0;d<num_due;d++) {
+		struct analysis *a=&analyses[due[d]];
+		if (a->end) a->end(a->state,iteration,analysis_partials+due_offset[d],num_blocks);
+	}
+	num_due=0;
+}
@@ -0,0 +1,52 @@
+#ifndef ANALYSIS_H
+#define ANALYSIS_H
+
+#include "model.h"
+
+// in-situ analyses of the model state
+// all registered analyses share a single traversal of the insects: the
+// insects are split into blocks, and every block is handed to all analyses
+// that are due while it is in cache. The traversal is the fused leap-frog
+// pass of the model, between the kick and the drift. Blocks are visited concurrently, so an
+// analysis accumulates into a per block partial result (partial_size bytes,
+// zeroed before the traversal) and combines the partials in end(), which is
+// called once with the partials in block order. With DEVICE, an analysis
+// that provides visit_device() computes all its partials on the offload
+// target instead, from the device arrays, see devicedata.h.
+
+#define MAX_ANALYSES 16
+#define ANALYSIS_BLOCK 512
+
+// read-only view of one block of the model state, the arrays are indexed by
+// insect index and the block covers begin..end-1
+struct analysis_view {
+	int iteration;
+	int begin, end;
+	const struct insect_data *insects;
+	const struct insect_action_data *actions;        // the total force of this step is
+	const struct insect_action_data *enemy_actions;  // actions+enemy_actions+slow_weight*slow_actions
+	const struct insect_action_data *slow_actions;
+	float slow_weight;
+	const struct leader_data *leaders;
+	int num_leaders;
+};
+
+struct analysis {
+	const char *name;
+	int period;                  // run every period iterations
+	size_t partial_size;
+	void *state;                 // passed to the callbacks
+	void (*begin)(void *state, int iteration);
+	void (*visit_block)(void *state, void *partial, const struct analysis_view *v);
+	void (*visit_device)(void *state, void *partials, int num_blocks);   // optional
+	void (*end)(void *state, int iteration, const void *partials, int num_blocks);
+};
+
+int analysis_register(const struct analysis *a);
+int analysis_due(int id, int iteration);
+int analysis_begin(int iteration);
+void analysis_visit_block(int iteration, int block);
+void analysis_visit_device(int iteration);
+void analysis_end(int iteration);
+
+#endif
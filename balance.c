@@ -0,0 +1,48 @@
+#include <stdlib.h>
+
+#include "support.h"
+#include "balance.h"
+
+void balance_init(struct balance* b, int n, int nparts) {
+	b->n=n;
+	b->nparts=nparts;
+	b->cost=mem_malloc(MEM_ENEMIES,n*sizeof(float));
+	b->bounds=mem_malloc(MEM_ENEMIES,(nparts+1)*sizeof(int));
+	b->busy=mem_calloc(MEM_ENEMIES,nparts,sizeof(double));
+	b->idle=mem_calloc(MEM_ENEMIES,nparts,sizeof(double));
+	for (int i=0;i<n;i++)
+		b->cost[i]=1;
+	balance_partition(b);
+}
+
+void balance_partition(struct balance* b) {
+	double total=0;
+	for (int i=0;i<b->n;i++)
+		total+=b->cost[i];
+	//cut where the running cost passes k/nparts of the total
+	double sum=0;
+	int k=1;
+	b->bounds[0]=0;
+	for (int i=0;i<b->n && k<b->nparts;i++) {
+		sum+=b->cost[i];
+		while (k<b->nparts && sum>=total*k/b->nparts)
+			b->bounds[k++]=i+1;
+	}
+	while (k<=b->nparts)
+		b->bounds[k++]=b->n;
+}
+
+void balance_begin(struct balance* b) {
+	b->start=now();
+}
+
+void balance_chunk_done(struct balance* b, int part, double busy) {
+	b->busy[part]=busy;
+}
+
+void balance_end(struct balance* b) {
+	double elapsed=now()-b->start;
+	for (int k=0;k<b->nparts;k++)
+		b->idle[k]=MAX(0,elapsed-b->busy[k]);
+	balance_partition(b);
+}
@@ -0,0 +1,22 @@
+#ifndef BALANCE_H
+#define BALANCE_H
+
+// cost-aware static partitioning of a loop over n items
+// the cost of every item is recorded while the loop runs, and the next run
+// is split into nparts contiguous chunks of (roughly) equal recorded cost
+struct balance {
+	int n, nparts;
+	float *cost;                 // per item cost measured in the last run
+	int *bounds;                 // chunk k covers items bounds[k]..bounds[k+1]-1
+	double *busy;                // per chunk busy time of the last run
+	double *idle;                // per chunk idle time (waiting for the slowest chunk)
+	double start;
+};
+
+void balance_init(struct balance* b, int n, int nparts);
+void balance_partition(struct balance* b);
+void balance_begin(struct balance* b);
+void balance_chunk_done(struct balance* b, int part, double busy);
+void balance_end(struct balance* b);
+
+#endif
@@ -0,0 +1,394 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <omp.h>
+
+#include "model.h"
+#include "support.h"
+#include "ranks.h"
+#include "devicedata.h"
+
+struct device_array_info {
+	const char *name;
+	void *host;                  // the packed array on the host, and its image on the target
+	size_t bytes;
+	void (*pack)(void *p);       // fills the host array from the model before a copy to the target
+	void (*unpack)(const void *p);   // and back after a copy from the target
+	int mapped;
+	int host_valid;
+	int target_valid;
+	long long bytes_to, bytes_from;
+};
+
+struct device_array_info device_arrays[NUM_DEVICE_ARRAYS];
+int device_data_active=0;
+
+void pack_positions(void *p) {
+	storage_t *pos=p;
+	#pragma omp taskloop
+	for (int i=0;i<NumInsects;i++) {
+		pos[4*i]  =insects[i].x;
+		pos[4*i+1]=insects[i].y;
+		pos[4*i+2]=insects[i].z;
+		pos[4*i+3]=insects[i].m;
+	}
+}
+
+void unpack_positions(const void *p) {
+	const storage_t *pos=p;
+	#pragma omp taskloop
+	for (int i=0;i<NumInsects;i++) {
+		insects[i].x=pos[4*i];
+		insects[i].y=pos[4*i+1];
+		insects[i].z=pos[4*i+2];
+		insects[i].m=pos[4*i+3];
+	}
+}
+
+void pack_velocities(void *p) {
+	velocity_t *vel=p;
+	#pragma omp taskloop
+	for (int i=0;i<NumInsects;i++) {
+		vel[4*i]  =insects[i].vx;
+		vel[4*i+1]=insects[i].vy;
+		vel[4*i+2]=insects[i].vz;
+		vel[4*i+3]=0;
+	}
+}
+
+void unpack_velocities(const void *p) {
+	const velocity_t *vel=p;
+	#pragma omp taskloop
+	for (int i=0;i<NumInsects;i++) {
+		insects[i].vx=vel[4*i];
+		insects[i].vy=vel[4*i+1];
+		insects[i].vz=vel[4*i+2];
+	}
+}
+
+void pack_tree(void *p) {
+	int *tree=p;
+	#pragma omp taskloop
+	for (int i=0;i<NumInsects;i++) {
+		int *t=&tree[DEVICE_TREE_STRIDE*i];
+		t[DEVICE_TREE_PARENT]=insects[i].parent;
+		t[DEVICE_TREE_LEADER]=(insects[i].leader_idx>=0);
+		t[DEVICE_TREE_NCHILD]=insects[i].nchildren;
+		for (int k=0;k<MAX_CHILDREN;k++)
+			t[DEVICE_TREE_CHILDREN+k]=(k<insects[i].nchildren)?insects[i].children[k]:-1;
+	}
+}
+
+void unpack_action_array(const compute_t *p, struct insect_action_data *out) {
+	#pragma omp taskloop
+	for (int i=0;i<NumInsects;i++) {
+		out[i].fx=p[4*i];
+		out[i].fy=p[4*i+1];
+		out[i].fz=p[4*i+2];
+		out[i].ep=p[4*i+3];
+	}
+}
+
+void unpack_actions(const void *p) {
+	unpack_action_array(p,actions);
+}
+
+void unpack_forces(const void *p) {
+	unpack_action_array(p,slow_actions);
+}
+
+void pack_forces(void *p) {
+	compute_t *acc=p;
+	#pragma omp taskloop
+	for (int i=0;i<NumInsects;i++) {
+		acc[4*i]  =slow_actions[i].fx;
+		acc[4*i+1]=slow_actions[i].fy;
+		acc[4*i+2]=slow_actions[i].fz;
+		acc[4*i+3]=slow_actions[i].ep;
+	}
+}
+
+void pack_enemies(void *p) {
+	compute_t *en=p;
+	#pragma omp taskloop
+	for (int i=0;i<NumInsects;i++) {
+		en[4*i]  =enemy_actions[i].fx;
+		en[4*i+1]=enemy_actions[i].fy;
+		en[4*i+2]=enemy_actions[i].fz;
+		en[4*i+3]=enemy_actions[i].rm;
+	}
+}
+
+void device_array_init(enum device_array a, const char *name, size_t bytes,
+		void (*pack)(void*), void (*unpack)(const void*)) {
+	struct device_array_info *d=&device_arrays[a];
+	d->name=name;
+	d->host=mem_malloc(MEM_FORCES,bytes);
+	d->bytes=bytes;
+	d->pack=pack;
+	d->unpack=unpack;
+	d->mapped=0;
+	d->host_valid=1;
+	d->target_valid=0;
+	d->bytes_to=0;
+	d->bytes_from=0;
+}
+
+void setup_device_data() {
+	//the host would need the whole state on every step in these modes
+	if (params.pm_grid>0 || params.validate || mpi_size>1) {
+		printf("DEVICE does not combine with PM_GRID, VALIDATE or several ranks\n");
+		exit(-1);
+	}
+	size_t n=NumInsects;
+	device_array_init(DEVICE_POSITIONS,"positions",4*n*sizeof(storage_t),pack_positions,unpack_positions);
+	device_array_init(DEVICE_VELOCITIES,"velocities",4*n*sizeof(velocity_t),pack_velocities,unpack_velocities);
+	device_array_init(DEVICE_TREE,"tree",DEVICE_TREE_STRIDE*n*sizeof(int),pack_tree,NULL);
+	device_array_init(DEVICE_ACTIONS,"actions",4*n*sizeof(compute_t),NULL,unpack_actions);
+	device_array_init(DEVICE_FORCES,"forces",4*n*sizeof(compute_t),pack_forces,unpack_forces);
+	device_array_init(DEVICE_ENEMIES,"enemies",4*n*sizeof(compute_t),pack_enemies,NULL);
+	device_data_active=1;
+	if (omp_get_num_devices()==0)
+		printf("device data: no offload device, the target regions run on the host\n");
+	else
+		printf("device data on device %d of %d\n",omp_get_default_device(),omp_get_num_devices());
+}
+
+void device_map(enum device_array a) {
+	struct device_array_info *d=&device_arrays[a];
+	if (d->mapped) return;
+	char *p=(char*)d->host;
+	size_t n=d->bytes;
+	#pragma omp target enter data map(alloc: p[0:n])
+	d->mapped=1;
+}
+
+void *device_array_data(enum device_array a) {
+	//the host address of the array, for map(alloc:) clauses of target regions
+	return device_arrays[a].host;
+}
+
+void done_device_data() {
+	if (!device_data_active) return;
+	//the host state at the end of the run
+	device_need_on_host(DEVICE_POSITIONS);
+	device_need_on_host(DEVICE_VELOCITIES);
+	device_need_on_host(DEVICE_ACTIONS);
+	device_need_on_host(DEVICE_FORCES);
+	for (int a=0;a<NUM_DEVICE_ARRAYS;a++) {
+		struct device_array_info *d=&device_arrays[a];
+		int mapped=d->mapped;
+		if (mapped) {
+			char *p=(char*)d->host;
+			size_t n=d->bytes;
+			#pragma omp target exit data map(release: p[0:n])
+			d->mapped=0;
+		}
+		printf("device data %s: %s, %lld bytes to the target, %lld bytes from it\n",
+			d->name,mapped?"mapped":"host only",d->bytes_to,d->bytes_from);
+		mem_free(d->host);
+	}
+	device_data_active=0;
+}
+
+void device_host_wrote(enum device_array a) {
+	if (!device_data_active) return;
+	device_arrays[a].host_valid=1;
+	device_arrays[a].target_valid=0;
+}
+
+void device_target_wrote(enum device_array a) {
+	if (!device_data_active) return;
+	device_map(a);
+	device_arrays[a].target_valid=1;
+	device_arrays[a].host_valid=0;
+}
+
+void device_need_on_host(enum device_array a) {
+	if (!device_data_active) return;
+	struct device_array_info *d=&device_arrays[a];
+	if (d->host_valid) return;
+	char *p=(char*)d->host;
+	size_t n=d->bytes;
+	#pragma omp target update from(p[0:n])
+	if (d->unpack) d->unpack(d->host);
+	d->host_valid=1;
+	d->bytes_from+=n;
+	COUNT(COUNTER_DEVICE_BYTES_FROM,n);
+}
+
+void device_need_on_target(enum device_array a) {
+	if (!device_data_active) return;
+	struct device_array_info *d=&device_arrays[a];
+	device_map(a);
+	if (d->target_valid) return;
+	if (d->pack) d->pack(d->host);
+	char *p=(char*)d->host;
+	size_t n=d->bytes;
+	#pragma omp target update to(p[0:n])
+	d->target_valid=1;
+	d->bytes_to+=n;
+	COUNT(COUNTER_DEVICE_BYTES_TO,n);
+}
+
+void device_fast_forces(int tree, int center) {
+	//the centre force and the tree springs of tree_force(), on the target;
+	//each insect gathers the springs to its parent and to its children, in
+	//the index order tree_force() scatters them in
+	device_need_on_target(DEVICE_POSITIONS);
+	device_need_on_target(DEVICE_TREE);
+	device_map(DEVICE_ACTIONS);
+	const storage_t *pos=device_arrays[DEVICE_POSITIONS].host;
+	const int *t=device_arrays[DEVICE_TREE].host;
+	compute_t *act=device_arrays[DEVICE_ACTIONS].host;
+	int n=NumInsects;
+	float r0=params.grouping_radius, D=params.grouping_constant;
+	compute_t c=params.center_force_constant;
+	#pragma omp target teams distribute parallel for map(alloc: pos[0:4*n], t[0:DEVICE_TREE_STRIDE*n], act[0:4*n])
+	for (int i=0;i<n;i++) {
+		compute_t fx=0, fy=0, fz=0, ep=0;
+		if (center) {
+			compute_t dx=pos[4*i], dy=pos[4*i+1], dz=pos[4*i+2];
+			fx+=-dx*c;
+			fy+=-dy*c;
+			fz+=-dz*c;
+			ep+=0.5*c*(dx*dx+dy*dy+dz*dz);
+		}
+		if (tree) {
+			const int *ti=&t[DEVICE_TREE_STRIDE*i];
+			int parent=ti[DEVICE_TREE_PARENT];
+			//the own spring at index i and the children's at theirs, in
+			//index order
+			int order[MAX_CHILDREN+1];
+			int m=0;
+			if (parent>=0 && parent!=i)
+				order[m++]=i;
+			for (int k=0;k<ti[DEVICE_TREE_NCHILD];k++) {
+				int child=ti[DEVICE_TREE_CHILDREN+k];
+				int j=m++;
+				for (;j>0 && order[j-1]>child;j--)
+					order[j]=order[j-1];
+				order[j]=child;
+			}
+			for (int k=0;k<m;k++) {
+				int own=(order[k]==i);
+				//the spring of the child on its parent, from the child's side
+				int a=own?i:order[k], b=own?parent:i;
+				compute_t dx=pos[4*a]-pos[4*b];
+				compute_t dy=pos[4*a+1]-pos[4*b+1];
+				compute_t dz=pos[4*a+2]-pos[4*b+2];
+				compute_t r=sqrt(dx*dx+dy*dy+dz*dz);
+				compute_t s=D*(r-r0)/r;
+				compute_t sx=-dx*s, sy=-dy*s, sz=-dz*s;
+				if (own) {
+					fx+=sx;
+					fy+=sy;
+					fz+=sz;
+					ep+=0.5*D*(r-r0)*(r-r0);
+				} else {
+					fx-=sx;
+					fy-=sy;
+					fz-=sz;
+				}
+			}
+		}
+		act[4*i]  =fx;
+		act[4*i+1]=fy;
+		act[4*i+2]=fz;
+		act[4*i+3]=ep;
+	}
+	device_target_wrote(DEVICE_ACTIONS);
+}
+
+void device_coulomb_repell(struct insect_action_data *out) {
+	//the full-row coulomb repulsion of repell_pair() on the target; the
+	//forces of out stay current on the target only
+	assert(out==slow_actions);
+	device_need_on_target(DEVICE_POSITIONS);
+	device_need_on_target(DEVICE_TREE);
+	device_map(DEVICE_FORCES);
+	const storage_t *pos=device_arrays[DEVICE_POSITIONS].host;
+	const int *t=device_arrays[DEVICE_TREE].host;
+	compute_t *acc=device_arrays[DEVICE_FORCES].host;
+	int n=NumInsects;
+	compute_t D=params.coulomb_constant;
+	compute_t r0=params.coulomb_radius;
+	long long rows=0;
+	#pragma omp target teams distribute parallel for reduction(+:rows) map(alloc: pos[0:4*n], t[0:DEVICE_TREE_STRIDE*n], acc[0:4*n])
+	for (int i=0;i<n;i++) {
+		compute_t fx=0, fy=0, fz=0, ep=0;
+		if (t[DEVICE_TREE_STRIDE*i+DEVICE_TREE_LEADER]) {
+			for (int j=0;j<n;j++) {
+				if (j==i) continue;
+				compute_t dx=pos[4*i]  -pos[4*j];
+				compute_t dy=pos[4*i+1]-pos[4*j+1];
+				compute_t dz=pos[4*i+2]-pos[4*j+2];
+				compute_t r=sqrt(dx*dx+dy*dy+dz*dz);
+				compute_t rr=r;
+				if (rr<r0) rr=r0;
+				compute_t a=D/(rr*rr*rr);
+				fx+=dx*a;
+				fy+=dy*a;
+				fz+=dz*a;
+				ep+=0.5*a*(1.5*rr*rr-0.5*r*r);
+			}
+			rows++;
+		}
+		acc[4*i]  =fx;
+		acc[4*i+1]=fy;
+		acc[4*i+2]=fz;
+		acc[4*i+3]=ep;
+	}
+	device_target_wrote(DEVICE_FORCES);
+	COUNT(COUNTER_COULOMB_PAIRS,rows*n);
+}
+
+void device_kick(float ws) {
+	//kick_block() on the target, from the tree, centre and coulomb forces
+	//kept there and the enemy forces of the host
+	device_need_on_target(DEVICE_POSITIONS);
+	device_need_on_target(DEVICE_VELOCITIES);
+	device_need_on_target(DEVICE_ENEMIES);
+	device_need_on_target(DEVICE_FORCES);
+	storage_t *pos=device_arrays[DEVICE_POSITIONS].host;
+	velocity_t *vel=device_arrays[DEVICE_VELOCITIES].host;
+	const compute_t *act=device_arrays[DEVICE_ACTIONS].host;
+	const compute_t *slow=device_arrays[DEVICE_FORCES].host;
+	const compute_t *en=device_arrays[DEVICE_ENEMIES].host;
+	int n=NumInsects;
+	float dt=params.dt;
+	float beta=params.damping_constant;
+	float mass_min=params.mass_min;
+	#pragma omp target teams distribute parallel for map(alloc: pos[0:4*n], vel[0:4*n], act[0:4*n], slow[0:4*n], en[0:4*n])
+	for (int i=0;i<n;i++) {
+		compute_t fx=act[4*i]  +en[4*i]  +ws*slow[4*i];
+		compute_t fy=act[4*i+1]+en[4*i+1]+ws*slow[4*i+1];
+		compute_t fz=act[4*i+2]+en[4*i+2]+ws*slow[4*i+2];
+		vel[4*i]  +=dt*(fx/pos[4*i+3]-vel[4*i]  *beta);
+		vel[4*i+1]+=dt*(fy/pos[4*i+3]-vel[4*i+1]*beta);
+		vel[4*i+2]+=dt*(fz/pos[4*i+3]-vel[4*i+2]*beta);
+		pos[4*i+3]+=dt*(en[4*i+3]);
+		pos[4*i+3] =MAX(pos[4*i+3],mass_min);
+	}
+	device_target_wrote(DEVICE_POSITIONS);
+	device_target_wrote(DEVICE_VELOCITIES);
+	COUNT(COUNTER_KICKS,n);
+}
+
+void device_drift() {
+	//drift_block() on the target; the centre force of the new positions is
+	//part of the next device_fast_forces()
+	device_need_on_target(DEVICE_POSITIONS);
+	device_need_on_target(DEVICE_VELOCITIES);
+	storage_t *pos=device_arrays[DEVICE_POSITIONS].host;
+	const velocity_t *vel=device_arrays[DEVICE_VELOCITIES].host;
+	int n=NumInsects;
+	float dt=params.dt;
+	#pragma omp target teams distribute parallel for map(alloc: pos[0:4*n], vel[0:4*n])
+	for (int i=0;i<n;i++) {
+		pos[4*i]  +=vel[4*i]  *dt;
+		pos[4*i+1]+=vel[4*i+1]*dt;
+		pos[4*i+2]+=vel[4*i+2]*dt;
+	}
+	device_target_wrote(DEVICE_POSITIONS);
+}
@@ -0,0 +1,56 @@
+#ifndef DEVICEDATA_H
+#define DEVICEDATA_H
+
+#include "model.h"
+
+// the model resident on an OpenMP offload target (DEVICE=1)
+// the insect state lives on the target from the first step on: the tree and
+// centre forces, the coulomb repulsion, the kick, the drift and the energy
+// analysis run there, on the target's copy, across all steps. The fields are
+// packed into their own arrays, in the types of the model's fields so that
+// the results are those of a run on the host. An array is mapped when it is
+// first used, and stays mapped until done_device_data(). Each array knows
+// whether its host and target copies are current, and is only copied when
+// a phase needs the stale side:
+// * the host reads the positions and masses when the enemies are engaged,
+//   and when a frame is captured for rendering or publishing
+// * the host writes the enemy forces in every step the enemies are engaged,
+//   and the tree when insects desert
+// Those are the only places that call device_need_on_host() and
+// device_host_wrote(); the host fields of the other arrays are stale until
+// done_device_data(). Without an offload device the target regions run on
+// the host, and the copies are no-ops that are still accounted.
+
+enum device_array {
+	DEVICE_POSITIONS,            // x, y, z and m, read and written on both sides
+	DEVICE_VELOCITIES,           // vx, vy, vz, target only
+	DEVICE_TREE,                 // parent, leader flag and children, from the host
+	DEVICE_ACTIONS,              // tree and centre force and potential, target only
+	DEVICE_FORCES,               // coulomb force and potential, target only
+	DEVICE_ENEMIES,              // enemy force and mass rate, from the host
+	NUM_DEVICE_ARRAYS
+};
+
+// ints per insect in DEVICE_TREE
+#define DEVICE_TREE_PARENT   0
+#define DEVICE_TREE_LEADER   1
+#define DEVICE_TREE_NCHILD   2
+#define DEVICE_TREE_CHILDREN 3
+#define DEVICE_TREE_STRIDE   (DEVICE_TREE_CHILDREN+MAX_CHILDREN)
+
+extern int device_data_active;
+
+void setup_device_data();
+void done_device_data();
+void *device_array_data(enum device_array a);
+void device_host_wrote(enum device_array a);
+void device_target_wrote(enum device_array a);
+void device_need_on_host(enum device_array a);
+void device_need_on_target(enum device_array a);
+
+void device_fast_forces(int tree, int center);
+void device_coulomb_repell(struct insect_action_data *out);
+void device_kick(float ws);
+void device_drift();
+
+#endif
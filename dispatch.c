@@ -0,0 +1,49 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "support.h"
+#include "kernels.h"
+
+// the kernel variants built by the Makefile, best first
+extern const struct kernels kernels_generic;
+#ifdef KERNEL_VARIANTS_X86
+extern const struct kernels kernels_sse42, kernels_avx2, kernels_avx512;
+#endif
+
+struct kernels kernels;
+
+int kernel_isa_supported(const char *isa) {
+	if (strcmp(isa,"generic")==0) return 1;
+#ifdef KERNEL_VARIANTS_X86
+	__builtin_cpu_init();
+	if (strcmp(isa,"sse42")==0) return __builtin_cpu_supports("sse4.2");
+	if (strcmp(isa,"avx2")==0) return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+	if (strcmp(isa,"avx512")==0) return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512dq");
+#endif
+	return 0;
+}
+
+void setup_kernels() {
+	const struct kernels *variants[]={
+#ifdef KERNEL_VARIANTS_X86
+		&kernels_avx512, &kernels_avx2, &kernels_sse42,
+#endif
+		&kernels_generic
+	};
+	int nvariants=sizeof(variants)/sizeof(variants[0]);
+	const char *isa=getenv("KERNEL_ISA");
+	if (isa && *isa==0) isa=NULL;
+	const struct kernels *k=NULL;
+	for (int v=0;v<nvariants && k==NULL;v++) {
+		if (isa && strcmp(isa,variants[v]->isa)!=0) continue;
+		if (kernel_isa_supported(variants[v]->isa))
+			k=variants[v];
+	}
+	if (k==NULL) {
+		printf("kernel isa %s not available on this cpu\n",isa);
+		exit(-1);
+	}
+	kernels=*k;
+	printf("kernel isa: %s\n",kernels.isa);
+}
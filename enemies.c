@@ -0,0 +1,327 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "model.h"
+#include "support.h"
+#include "enemies.h"
+#include "kernels.h"
+
+//the enemies of a leader only depend on the leader, so they are collected
+//once per leader and iteration and shared by all of its followers
+struct enemy_list *enemy_lists;
+
+//followers of each leader, ordered by index
+int *follower_offset;
+int *followers;
+
+//defender side interaction records, one per (leader, enemy)
+int num_records, records_capacity;
+compute_t *record_fx, *record_fy, *record_fz, *record_rm;
+
+//records bucketed by enemy, bucket_count holds per part of the leaders the
+//number of records of every enemy and then the part's next slot
+int *bucket_offset;
+int *bucket_count;
+int *buckets;
+int bucket_nparts;
+
+//the phase 1 loop over leaders is split into chunks of equal cost, where the
+//cost of a leader is the number of engagements in the last iteration
+struct balance enemies_balance;
+
+float distance(int a, int b) {
+	float dx,dy,dz,r;
+	dx=insects[a].x-insects[b].x;
+	dy=insects[a].y-insects[b].y;
+	dz=insects[a].z-insects[b].z;
+	r=sqrt(dx*dx+dy*dy+dz*dz);
+	return r;
+}
+
+int relevant_enemy(int leader, int target) {
+	return (distance(leader, target)<=params.attack_radius) && (insects[target].leader_idx>=0);
+}
+
+void enemy_list_add(struct enemy_list *l, int target_idx) {
+	if (l->n==l->capacity) {
+		l->capacity=MAX(64,2*l->capacity);
+		l->idx=mem_realloc(MEM_ENEMIES,l->idx,l->capacity*sizeof(int));
+		l->x=mem_realloc(MEM_ENEMIES,l->x,l->capacity*sizeof(compute_t));
+		l->y=mem_realloc(MEM_ENEMIES,l->y,l->capacity*sizeof(compute_t));
+		l->z=mem_realloc(MEM_ENEMIES,l->z,l->capacity*sizeof(compute_t));
+		l->m=mem_realloc(MEM_ENEMIES,l->m,l->capacity*sizeof(compute_t));
+	}
+	int k=l->n++;
+	l->idx[k]=target_idx;
+	l->x[k]=insects[target_idx].x;
+	l->y[k]=insects[target_idx].y;
+	l->z[k]=insects[target_idx].z;
+	l->m[k]=insects[target_idx].m;
+}
+
+int collect_descendants(struct enemy_list *l, int target_idx, int leader_idx) {
+	//add target and all of its descendants that are a relevant enemy to leader
+	//returns the number of insects tested
+	if (relevant_enemy(leader_idx,target_idx))
+		enemy_list_add(l,target_idx);
+	struct insect_data *target=&insects[target_idx];
+	int tests=1;
+	for (int i=0;i<target->nchildren;i++)
+		tests+=collect_descendants(l,target->children[i],leader_idx);
+	return tests;
+}
+
+void enemy_list_swap(struct enemy_list *l, int a, int b) {
+	int t=l->idx[a]; l->idx[a]=l->idx[b]; l->idx[b]=t;
+	compute_t u;
+	u=l->x[a]; l->x[a]=l->x[b]; l->x[b]=u;
+	u=l->y[a]; l->y[a]=l->y[b]; l->y[b]=u;
+	u=l->z[a]; l->z[a]=l->z[b]; l->z[b]=u;
+	u=l->m[a]; l->m[a]=l->m[b]; l->m[b]=u;
+}
+
+void collect_enemies(int leader_id) {
+	struct enemy_list *l=&enemy_lists[leader_id];
+	int leader_idx=leaders[leader_id].insect_idx;
+	l->n=0;
+
+	long long tests=0;
+	int node_idx=leader_idx;
+	int parent_idx=insects[leader_idx].parent;
+	while (parent_idx>=0) {
+		struct insect_data *parent=&insects[parent_idx];
+		//all peers of node are enenmies, i.e. all children of parent except node
+		for (int i=0;i<parent->nchildren;i++) {
+			int child_idx=parent->children[i];
+			if (child_idx!=node_idx)
+				tests+=collect_descendants(l,child_idx,leader_idx);
+		}
+		//ascend to parent
+		node_idx=parent_idx;
+		parent_idx=parent->parent;
+	}
+	//the enemies kicked on this step first, all of them without block steps
+	l->nactive=0;
+	for (int k=0;k<l->n;k++)
+		if (step_active(l->idx[k]))
+			enemy_list_swap(l,k,l->nactive++);
+	COUNT(COUNTER_ENEMY_TESTS,tests);
+}
+
+void collect_all_enemies() {
+	#pragma omp taskloop grainsize(1)
+	for (int k=0;k<NumLeaders;k++)
+		collect_enemies(k);
+}
+
+void collect_followers() {
+	if (followers==NULL) {
+		follower_offset=mem_malloc(MEM_ENEMIES,(MAX_NUM_LEADERS+1)*sizeof(int));
+		followers=mem_malloc(MEM_ENEMIES,NumInsects*sizeof(int));
+	}
+	for (int k=0;k<=NumLeaders;k++)
+		follower_offset[k]=0;
+	for (int i=0;i<NumInsects;i++)
+		if (insects[i].leader_idx>=0)
+			follower_offset[insects[i].leader_id+1]++;
+	for (int k=0;k<NumLeaders;k++)
+		follower_offset[k+1]+=follower_offset[k];
+	for (int i=0;i<NumInsects;i++)
+		if (insects[i].leader_idx>=0)
+			followers[follower_offset[insects[i].leader_id]++]=i;
+	//the fill moved each offset to the start of the next leader
+	for (int k=NumLeaders;k>0;k--)
+		follower_offset[k]=follower_offset[k-1];
+	follower_offset[0]=0;
+}
+
+void reserve_records() {
+	num_records=0;
+	for (int k=0;k<NumLeaders;k++) {
+		enemy_lists[k].record=num_records;
+		num_records+=enemy_lists[k].n;
+	}
+	if (num_records>records_capacity) {
+		records_capacity=MAX(num_records,2*records_capacity);
+		record_fx=mem_realloc(MEM_ENEMIES,record_fx,records_capacity*sizeof(compute_t));
+		record_fy=mem_realloc(MEM_ENEMIES,record_fy,records_capacity*sizeof(compute_t));
+		record_fz=mem_realloc(MEM_ENEMIES,record_fz,records_capacity*sizeof(compute_t));
+		record_rm=mem_realloc(MEM_ENEMIES,record_rm,records_capacity*sizeof(compute_t));
+		buckets=mem_realloc(MEM_ENEMIES,buckets,records_capacity*sizeof(int));
+	}
+	if (bucket_offset==NULL) {
+		bucket_offset=mem_malloc(MEM_ENEMIES,(NumInsects+1)*sizeof(int));
+		bucket_nparts=max_threads();
+		bucket_count=mem_malloc(MEM_ENEMIES,(size_t)bucket_nparts*NumInsects*sizeof(int));
+	}
+}
+
+int engage_leader(int leader_id) {
+	//phase 1: all followers of the leader engage all of its enemies
+	struct enemy_list *l=&enemy_lists[leader_id];
+	int ne=l->n;
+	struct engage_args args;
+	args.ne=ne;
+	args.ex=l->x;
+	args.ey=l->y;
+	args.ez=l->z;
+	args.em=l->m;
+	args.dfx=&record_fx[l->record];
+	args.dfy=&record_fy[l->record];
+	args.dfz=&record_fz[l->record];
+	args.drm=&record_rm[l->record];
+	args.r0=params.attack_radius;
+	args.ka=params.attack_constant;
+	args.kd=params.defend_constant;
+	args.fight_radius=params.fight_radius;
+	args.fight_rate=params.fight_mass_rate;
+	args.ratio=params.surrender_mass_ratio;
+	args.desert_rm=.1/params.dt;
+
+	for (int k=0;k<ne;k++) {
+		args.dfx[k]=0;
+		args.dfy[k]=0;
+		args.dfz[k]=0;
+		args.drm[k]=0;
+	}
+	int engagements=0;
+	for (int f=follower_offset[leader_id];f<follower_offset[leader_id+1];f++) {
+		int attack=followers[f];
+		//a follower not kicked on this step only engages for its enemies
+		//that are, and does not desert
+		int active=step_active(attack);
+		args.ne=active ? ne : l->nactive;
+		if (args.ne==0) continue;
+		struct engage_result r;
+		kernels.engage(&args,insects[attack].x,insects[attack].y,insects[attack].z,insects[attack].m,&r);
+		enemy_actions[attack].fx+=r.fx;
+		enemy_actions[attack].fy+=r.fy;
+		enemy_actions[attack].fz+=r.fz;
+		enemy_actions[attack].rm+=r.rm;
+		if (r.win>=0 && active)
+			enemy_actions[attack].new_parent=l->idx[r.win];
+		COUNT(COUNTER_FIGHTS,r.fights);
+		engagements+=args.ne;
+	}
+	COUNT(COUNTER_ENGAGEMENTS,engagements);
+	return engagements;
+}
+
+void engage_all_enemies() {
+	struct balance *b=&enemies_balance;
+	clear_actions(enemy_actions);
+	if (enemy_lists==NULL)
+		enemy_lists=mem_calloc(MEM_ENEMIES,MAX_NUM_LEADERS,sizeof(struct enemy_list));
+	collect_all_enemies();
+	collect_followers();
+	reserve_records();
+	if (b->cost==NULL) balance_init(b,NumLeaders,max_threads());
+
+	//phase 1, balanced over leaders
+	balance_begin(b);
+	for (int part=0;part<b->nparts;part++) {
+		#pragma omp task firstprivate(part)
+		{
+			double t0=now();
+			for (int k=b->bounds[part];k<b->bounds[part+1];k++)
+				b->cost[k]=1+engage_leader(k);
+			balance_chunk_done(b,part,now()-t0);
+		}
+	}
+	#pragma omp taskwait
+	balance_end(b);
+
+	//phase 2, bucket the records by enemy: every part of the leaders counts
+	//its records per enemy, a prefix sum over enemies and parts gives each
+	//part its own slots, so the buckets fill in record (i.e. leader) order
+	int np=bucket_nparts;
+	#pragma omp taskloop grainsize(1)
+	for (int p=0;p<np;p++) {
+		int *count=&bucket_count[(size_t)p*NumInsects];
+		memset(count,0,NumInsects*sizeof(int));
+		for (int k=p*NumLeaders/np;k<(p+1)*NumLeaders/np;k++) {
+			struct enemy_list *l=&enemy_lists[k];
+			for (int j=0;j<l->n;j++)
+				count[l->idx[j]]++;
+		}
+	}
+	#pragma omp taskloop
+	for (int i=0;i<NumInsects;i++) {
+		int n=0;
+		for (int p=0;p<np;p++)
+			n+=bucket_count[(size_t)p*NumInsects+i];
+		bucket_offset[i+1]=n;
+	}
+	bucket_offset[0]=0;
+	for (int i=0;i<NumInsects;i++)
+		bucket_offset[i+1]+=bucket_offset[i];
+	#pragma omp taskloop
+	for (int i=0;i<NumInsects;i++) {
+		int slot=bucket_offset[i];
+		for (int p=0;p<np;p++) {
+			int *count=&bucket_count[(size_t)p*NumInsects+i];
+			int n=*count;
+			*count=slot;
+			slot+=n;
+		}
+	}
+	#pragma omp taskloop grainsize(1)
+	for (int p=0;p<np;p++) {
+		int *fill=&bucket_count[(size_t)p*NumInsects];
+		for (int k=p*NumLeaders/np;k<(p+1)*NumLeaders/np;k++) {
+			struct enemy_list *l=&enemy_lists[k];
+			for (int j=0;j<l->n;j++)
+				buckets[fill[l->idx[j]]++]=l->record+j;
+		}
+	}
+	//and reduce each bucket
+	#pragma omp taskloop grainsize(256)
+	for (int i=0;i<NumInsects;i++) {
+		int b0=bucket_offset[i], b1=bucket_offset[i+1];
+		compute_t fx=0,fy=0,fz=0,rm=0;
+		for (int s=b0;s<b1;s++) {
+			int r=buckets[s];
+			fx+=record_fx[r];
+			fy+=record_fy[r];
+			fz+=record_fz[r];
+			rm+=record_rm[r];
+		}
+		enemy_actions[i].fx+=fx;
+		enemy_actions[i].fy+=fy;
+		enemy_actions[i].fz+=fz;
+		enemy_actions[i].rm+=rm;
+	}
+}
+
+void enemies_save(struct enemies_state *e) {
+	e->lists=enemy_lists;
+	e->follower_offset=follower_offset;
+	e->followers=followers;
+	e->num_records=num_records;
+	e->records_capacity=records_capacity;
+	e->record_fx=record_fx;
+	e->record_fy=record_fy;
+	e->record_fz=record_fz;
+	e->record_rm=record_rm;
+	e->bucket_offset=bucket_offset;
+	e->bucket_count=bucket_count;
+	e->buckets=buckets;
+	e->balance=enemies_balance;
+}
+
+void enemies_load(const struct enemies_state *e) {
+	enemy_lists=e->lists;
+	follower_offset=e->follower_offset;
+	followers=e->followers;
+	num_records=e->num_records;
+	records_capacity=e->records_capacity;
+	record_fx=e->record_fx;
+	record_fy=e->record_fy;
+	record_fz=e->record_fz;
+	record_rm=e->record_rm;
+	bucket_offset=e->bucket_offset;
+	bucket_count=e->bucket_count;
+	buckets=e->buckets;
+	enemies_balance=e->balance;
+}
@@ -0,0 +1,50 @@
+#ifndef ENEMIES_H
+#define ENEMIES_H
+
+#include "balance.h"
+#include "precision.h"
+
+// attack, defend and fight between the followers of each leader and the
+// leader's enemies, resolved in two phases:
+//  1. per leader: every follower engages every enemy in the leader's enemy
+//     list. The follower's own force, mass rate and new parent are
+//     accumulated directly into enemy_actions, the defender's side is emitted as one
+//     interaction record per (leader, enemy)
+//  2. per enemy: the records are bucketed by enemy in leader order, with
+//     a prefix sum over per part counts, and reduced into the enemy's force
+//     and mass rate
+// with block time steps the followers not kicked on a step only engage the
+// enemies that are, so that exactly the pairs with an insect kicked on the
+// step are evaluated, and both sides' mass transfers with them
+// both phases write to disjoint data, so they run in parallel without
+// atomics and the outcome does not depend on the number of threads
+
+struct enemy_list {
+	int n, capacity;
+	int nactive;                 // the first ones, kicked on this step
+	int *idx;                    // enemy insects, in tree traversal order
+	compute_t *x,*y,*z,*m;       // and their positions and masses
+	int record;                  // index of the first interaction record
+};
+
+// the buffers of the enemy loop, to switch between models
+// a zeroed state is that of a new model
+struct enemies_state {
+	struct enemy_list *lists;
+	int *follower_offset, *followers;
+	int num_records, records_capacity;
+	compute_t *record_fx, *record_fy, *record_fz, *record_rm;
+	int *bucket_offset, *bucket_count, *buckets;
+	struct balance balance;
+};
+
+extern struct enemy_list *enemy_lists;
+extern struct balance enemies_balance;
+
+int relevant_enemy(int leader, int target);
+void collect_all_enemies();
+void engage_all_enemies();
+void enemies_save(struct enemies_state *e);
+void enemies_load(const struct enemies_state *e);
+
+#endif
@@ -0,0 +1,202 @@
+#define _DEFAULT_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "main.h"
+#include "support.h"
+#include "model.h"
+#include "enemies.h"
+#include "render.h"
+#include "logging.h"
+#include "frame.h"
+#include "ensemble.h"
+
+#define MAX_ENSEMBLE_MEMBERS 256
+
+// the members take turns as the current model: model_load() and friends
+// point the model's globals to the member's state
+struct ensemble_member {
+	char name[64];
+	char overrides[1024];        // the member's parameters as key=value pairs
+	struct model_state model;
+	struct enemies_state enemies;
+	struct log_files logs;
+	struct output_slot slots[NUM_OUTPUT_SLOTS];
+	struct render_policy render;
+	long long counters[NUM_COUNTERS];    // counted for the member this iteration
+};
+
+int num_members;
+struct ensemble_member *members;
+
+void member_load(struct ensemble_member *m) {
+	model_load(&m->model);
+	enemies_load(&m->enemies);
+	log_files=m->logs;
+}
+
+void member_save(struct ensemble_member *m) {
+	model_save(&m->model);
+	enemies_save(&m->enemies);
+	m->logs=log_files;
+}
+
+void apply_overrides(struct ensemble_member *m) {
+	char buf[sizeof(m->overrides)];
+	strcpy(buf,m->overrides);
+	for (char *tok=strtok(buf," \t\n"); tok; tok=strtok(NULL," \t\n")) {
+		char *eq=strchr(tok,'=');
+		if (eq==NULL) {
+			printf("ensemble member %s: expected <parameter>=<value>, got %s\n",m->name,tok);
+			exit(-1);
+		}
+		*eq=0;
+		if (!set_parameter(&params,tok,eq+1)) {
+			printf("ensemble member %s: unknown parameter %s\n",m->name,tok);
+			exit(-1);
+		}
+	}
+}
+
+void read_ensemble(const char *filename) {
+	FILE *f=fopen(filename,"r");
+	if (f==NULL) {
+		printf("cannot open ensemble file %s\n",filename);
+		exit(-1);
+	}
+	members=mem_calloc(MEM_MODEL,MAX_ENSEMBLE_MEMBERS,sizeof(struct ensemble_member));
+	num_members=0;
+	char line[1024];
+	while (fgets(line,sizeof(line),f)) {
+		char name[64];
+		int n;
+		if (sscanf(line," %63s%n",name,&n)!=1 || name[0]=='#') continue;
+		if (num_members==MAX_ENSEMBLE_MEMBERS) {
+			printf("too many ensemble members\n");
+			exit(-1);
+		}
+		struct ensemble_member *m=&members[num_members++];
+		strcpy(m->name,name);
+		strcpy(m->overrides,line+n);
+	}
+	fclose(f);
+	if (num_members==0) {
+		printf("no members in ensemble file %s\n",filename);
+		exit(-1);
+	}
+}
+
+void setup_ensemble(const char *filename) {
+	read_ensemble(filename);
+	for (int k=0;k<num_members;k++) {
+		struct ensemble_member *m=&members[k];
+		setup_params();
+		apply_overrides(m);
+		if (params.pm_grid>0 || params.validate || params.frame_shm || params.device) {
+			printf("ensemble mode does not support PM_GRID, VALIDATE, FRAME_SHM or DEVICE\n");
+			exit(-1);
+		}
+		char *dir=mem_malloc(MEM_MODEL,strlen(params.output_dir)+strlen(m->name)+2);
+		sprintf(dir,"%s/%s",params.output_dir,m->name);
+		mkdir(dir,0755);
+		params.output_dir=dir;
+		struct enemies_state empty={0};
+		enemies_load(&empty);
+		setup_world();
+		setup_logging();
+		if (params.render)
+			render_policy_init(&m->render,&params);
+		for (int s=0;s<NUM_OUTPUT_SLOTS;s++) {
+			frame_init(&m->slots[s].frame,NumInsects);
+			log_record_init(&m->slots[s].log);
+		}
+		member_save(m);
+		printf("ensemble member %s: %d insects, %d leaders\n",m->name,NumInsects,NumLeaders);
+	}
+}
+
+void member_count(struct ensemble_member *m) {
+	//the counters are global, what they counted since the last call was the member's
+	long long counts[NUM_COUNTERS];
+	counters_collect(counts);
+	for (int c=0;c<NUM_COUNTERS;c++)
+		m->counters[c]+=counts[c];
+}
+
+void run_ensemble(const char *filename) {
+	setup_ensemble(filename);
+	struct coulomb_batch *batch=mem_malloc(MEM_MODEL,num_members*sizeof(struct coulomb_batch));
+	int *batch_member=mem_malloc(MEM_MODEL,num_members*sizeof(int));
+	//not a member parameter, so the same for all members
+	int num_iterations=members[0].model.params.num_iterations;
+	int image_chain, log_chain;
+	long long counts[NUM_COUNTERS];
+	counters_collect(counts);
+	#pragma omp parallel
+	#pragma omp single
+	for (int i=0;i<num_iterations;i++) {
+		//every member computes its fast forces, and the slow forces unless
+		//they can be batched
+		int nb=0;
+		for (int k=0;k<num_members;k++) {
+			struct ensemble_member *m=&members[k];
+			struct output_slot *slot=&m->slots[i%NUM_OUTPUT_SLOTS];
+			//wait for the slot's previous frame to be rendered and logged
+			#pragma omp taskwait depend(inout: slot->frame)
+			member_load(m);
+			int s=section_start(m->name);
+			if (i==params.rivalism_iteration) {
+				model_enable_rivalism();
+				apply_overrides(m);
+			}
+			batch_member[nb]=k;
+			nb+=iteration_forces(&batch[nb]);
+			section_end(s);
+			member_save(m);
+			member_count(m);
+		}
+		//the coulomb repulsion of all members, spread over the threads together
+		int s=section_start("coulomb batch");
+		coulomb_half_pairs_batch(batch,nb);
+		section_end(s);
+		//the half-pair tiles of a member evaluate each of its n*(n-1)/2 pairs once
+		counters_collect(counts);
+		for (int b=0;b<nb;b++)
+			members[batch_member[b]].counters[COUNTER_COULOMB_PAIRS]+=(long long)batch[b].n*(batch[b].n-1)/2;
+		for (int k=0;k<num_members;k++) {
+			struct ensemble_member *m=&members[k];
+			struct output_slot *slot=&m->slots[i%NUM_OUTPUT_SLOTS];
+			member_load(m);
+			int s=section_start(m->name);
+			iteration_finish(&slot->frame);
+			section_end(s);
+			member_count(m);
+			log_collect(&slot->log,i);
+			for (int c=0;c<NUM_COUNTERS;c++) {
+				slot->log.counters[c]=m->counters[c];
+				m->counters[c]=0;
+			}
+			log_record_section(&slot->log,m->name);
+			log_record_section(&slot->log,"coulomb batch");
+			member_save(m);
+			float scale=params.render?render_due(&m->render,i):0;
+			if (scale>0) {
+				#pragma omp task depend(inout: slot->frame) depend(inout: image_chain)
+				{
+					render_policy_frame(&m->render,&slot->frame,scale);
+					log_record_section(&slot->log,"image");
+				}
+			}
+			#pragma omp task depend(in: slot->frame) depend(inout: log_chain)
+			log_write(&slot->log);
+		}
+	}
+	for (int k=0;k<num_members;k++) {
+		member_load(&members[k]);
+		if (params.render)
+			render_policy_done(&members[k].render,num_iterations);
+		done_logging();
+	}
+}
@@ -0,0 +1,19 @@
+#ifndef ENSEMBLE_H
+#define ENSEMBLE_H
+
+// ensemble mode: one process advances several independent models
+// the members keep their own arrays and take turns as the current model;
+// only their half-pair coulomb tiles are evaluated together, everything else
+// runs member after member, see README.md
+// the members are read from a file with one member per line,
+//   <name> <parameter>=<value> ...
+// where the parameters are fields of struct model_parameters that override
+// the defaults (again after rivalism is enabled). Each member writes its
+// logs and images to <output_dir>/<name>. ITERATIONS is not a member
+// parameter, all members run the number of iterations of the environment.
+// The counters in log-timings.txt are those of the member, the batched
+// coulomb pairs included.
+
+void run_ensemble(const char *filename);
+
+#endif
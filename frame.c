@@ -0,0 +1,44 @@
+#include <stdlib.h>
+
+#include "model.h"
+#include "support.h"
+#include "frame.h"
+
+void frame_init(struct frame *f, int num_insects) {
+	f->output_dir=params.output_dir;
+	f->iteration=-1;
+	f->num_insects=num_insects;
+	f->num_leaders=0;
+	f->x=mem_malloc(MEM_FRAMES,num_insects*sizeof(float));
+	f->y=mem_malloc(MEM_FRAMES,num_insects*sizeof(float));
+	f->z=mem_malloc(MEM_FRAMES,num_insects*sizeof(float));
+	f->parent=mem_malloc(MEM_FRAMES,num_insects*sizeof(int));
+	f->leader_id=mem_malloc(MEM_FRAMES,num_insects*sizeof(int));
+	f->hue=mem_malloc(MEM_FRAMES,MAX_NUM_LEADERS*sizeof(float));
+}
+
+void frame_capture_begin(struct frame *f, int iteration) {
+	f->output_dir=params.output_dir;
+	f->iteration=iteration;
+	f->num_insects=NumInsects;
+	f->num_leaders=NumLeaders;
+	for (int k=0;k<NumLeaders;k++)
+		f->hue[k]=leaders[k].hue;
+}
+
+void frame_capture_block(struct frame *f, int i0, int i1) {
+	for (int i=i0;i<i1;i++) {
+		f->x[i]=insects[i].x;
+		f->y[i]=insects[i].y;
+		f->z[i]=insects[i].z;
+		f->parent[i]=insects[i].parent;
+		f->leader_id[i]=insects[i].leader_id;
+	}
+}
+
+void frame_capture(struct frame *f, int iteration) {
+	frame_capture_begin(f,iteration);
+	#pragma omp taskloop
+	for (int i=0;i<NumInsects;i++)
+		frame_capture_block(f,i,i+1);
+}
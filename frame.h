@@ -0,0 +1,22 @@
+#ifndef FRAME_H
+#define FRAME_H
+
+// compact snapshot of the model state needed to draw one image
+// rendering works on a frame, so that it can run while the model advances
+struct frame {
+	const char *output_dir;      // where the image goes
+	int iteration;
+	int num_insects;
+	int num_leaders;
+	float *x,*y,*z;              // positions
+	int *parent;                 // index to the parent insect
+	int *leader_id;              // the leader insect's index in leaders[]
+	float *hue;                  // hue value per leader
+};
+
+void frame_init(struct frame *f, int num_insects);
+void frame_capture(struct frame *f, int iteration);
+void frame_capture_begin(struct frame *f, int iteration);
+void frame_capture_block(struct frame *f, int i0, int i1);
+
+#endif
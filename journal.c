@@ -0,0 +1,26 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "model.h"
+#include "logging.h"
+#include "journal.h"
+
+void journal_snapshot(FILE *f) {
+	struct journal_header h;
+	memcpy(h.magic,JOURNAL_MAGIC,sizeof(h.magic));
+	h.num_insects=NumInsects;
+	h.num_leaders=NumLeaders;
+	fwrite(&h,sizeof(h),1,f);
+	for (int i=0;i<NumInsects;i++) {
+		struct journal_insect s={insects[i].parent,insects[i].leader_idx,insects[i].leader_id};
+		fwrite(&s,sizeof(s),1,f);
+	}
+}
+
+void journal_event(int kind, int insect, int old_parent, int new_parent) {
+	//called by the tree operations, which run serially
+	FILE *f=log_files.journal;
+	if (f==NULL) return;
+	struct journal_event e={model_step,kind,insect,old_parent,new_parent,insects[insect].leader_id};
+	fwrite(&e,sizeof(e),1,f);
+}
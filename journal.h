@@ -0,0 +1,46 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+// binary journal of the changes to the leadership tree (JOURNAL=1)
+// journal.bin holds a header, the tree before the first iteration, one
+// journal_insect per insect, and then the events in the order they
+// happened. Applying the events of iterations up to i to the snapshot
+// gives the tree of iteration i as logged, see replay.c.
+
+#define JOURNAL_MAGIC "INSJRNL1"
+
+struct journal_header {
+	char magic[8];
+	int32_t num_insects;
+	int32_t num_leaders;
+};
+
+struct journal_insect {
+	int32_t parent;
+	int32_t leader_idx;
+	int32_t leader_id;
+};
+
+enum journal_kind {
+	JOURNAL_ADD,                 // insect attached below new_parent, its subtree follows new_parent's leader
+	JOURNAL_REMOVE,              // insect detached from old_parent, it has no children and no leader left
+	JOURNAL_MOVE,                // child promoted into its parent's place, keeps its leader
+	JOURNAL_PROMOTE              // insect becomes leader leader_id of its subtree
+};
+
+struct journal_event {
+	int32_t iteration;
+	int32_t kind;
+	int32_t insect;
+	int32_t old_parent;
+	int32_t new_parent;
+	int32_t leader_id;           // the insect's leader afterwards, -1 for none
+};
+
+void journal_snapshot(FILE *f);
+void journal_event(int kind, int insect, int old_parent, int new_parent);
+
+#endif
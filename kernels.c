@@ -0,0 +1,103 @@
+#include <math.h>
+
+#include "support.h"
+#include "kernels.h"
+
+// KERNEL_ISA is set by the Makefile for every compilation of this file
+#define KERNEL_CAT2(a,b) a##_##b
+#define KERNEL_CAT(a,b) KERNEL_CAT2(a,b)
+#define KERNEL(name) KERNEL_CAT(name,KERNEL_ISA)
+#define KERNEL_STR2(a) #a
+#define KERNEL_STR(a) KERNEL_STR2(a)
+
+static void KERNEL(coulomb_tile)(int i0, int i1, int j0, int j1, const compute_t*restrict pos, compute_t*restrict acc, compute_t D, compute_t r0) {
+	for (int i=i0;i<i1;i++) {
+		compute_t xi=pos[4*i],yi=pos[4*i+1],zi=pos[4*i+2],li=pos[4*i+3];
+		compute_t fxi=0,fyi=0,fzi=0,epi=0;
+		for (int j=(j0>i?j0:i+1);j<j1;j++) {
+			compute_t dx=xi-pos[4*j];
+			compute_t dy=yi-pos[4*j+1];
+			compute_t dz=zi-pos[4*j+2];
+			compute_t r=sqrt(dx*dx+dy*dy+dz*dz);
+			compute_t rr=MAX(r,r0);
+			compute_t a=D/(rr*rr*rr);
+			compute_t ep=0.5*a*(1.5*rr*rr-0.5*r*r);
+			compute_t lj=pos[4*j+3];
+			fxi+=dx*a;
+			fyi+=dy*a;
+			fzi+=dz*a;
+			epi+=ep;
+			acc[4*j]  -=lj*dx*a;
+			acc[4*j+1]-=lj*dy*a;
+			acc[4*j+2]-=lj*dz*a;
+			acc[4*j+3]+=lj*ep;
+		}
+		acc[4*i]  +=li*fxi;
+		acc[4*i+1]+=li*fyi;
+		acc[4*i+2]+=li*fzi;
+		acc[4*i+3]+=li*epi;
+	}
+}
+
+static void KERNEL(engage)(const struct engage_args *args, compute_t xa, compute_t ya, compute_t za, compute_t ma, struct engage_result *res) {
+	int ne=args->ne;
+	const compute_t*restrict ex=args->ex;
+	const compute_t*restrict ey=args->ey;
+	const compute_t*restrict ez=args->ez;
+	const compute_t*restrict em=args->em;
+	compute_t*restrict dfx=args->dfx;
+	compute_t*restrict dfy=args->dfy;
+	compute_t*restrict dfz=args->dfz;
+	compute_t*restrict drm=args->drm;
+	compute_t r0=args->r0, ka=args->ka, kd=args->kd;
+	compute_t fight_radius=args->fight_radius, fight_rate=args->fight_rate;
+	compute_t ratio=args->ratio, desert_rm=args->desert_rm;
+	compute_t fx=0,fy=0,fz=0,rm=0;
+	int win=-1, fights=0;
+	#pragma omp simd reduction(+:fx,fy,fz,rm,fights) reduction(max:win)
+	for (int k=0;k<ne;k++) {
+		compute_t dx=ex[k]-xa;
+		compute_t dy=ey[k]-ya;
+		compute_t dz=ez[k]-za;
+		compute_t r=sqrt(dx*dx+dy*dy+dz*dz);
+		compute_t rr=MAX(r,r0);
+		compute_t inv=1/(rr*rr*rr);
+		compute_t a=ka*inv;
+		compute_t d=kd*inv;
+		fx+=dx*a;
+		fy+=dy*a;
+		fz+=dz*a;
+		dfx[k]+=dx*d;
+		dfy[k]+=dy*d;
+		dfz[k]+=dz*d;
+		if (r<fight_radius) {
+			compute_t md=em[k];
+			fights++;
+			if (ma/md>ratio) {
+				//attack wins
+			} else if (md/ma>ratio) {
+				//defend wins, the last winning defender becomes the new parent
+				win=k;
+				rm+=desert_rm;
+				drm[k]-=desert_rm;
+			} else {
+				//mass transfer to heavier one
+				compute_t t=fight_rate*(ma-md)/(ma+md);
+				drm[k]-=t;
+				rm+=t;
+			}
+		}
+	}
+	res->fx=fx;
+	res->fy=fy;
+	res->fz=fz;
+	res->rm=rm;
+	res->win=win;
+	res->fights=fights;
+}
+
+const struct kernels KERNEL(kernels)={
+	KERNEL_STR(KERNEL_ISA),
+	KERNEL(coulomb_tile),
+	KERNEL(engage)
+};
@@ -0,0 +1,39 @@
+#ifndef KERNELS_H
+#define KERNELS_H
+
+#include "precision.h"
+
+// hot loops compiled for several instruction sets
+// kernels.c is compiled once per ISA with the matching -m flags, every
+// object defines a table kernels_<isa>, and setup_kernels() picks the best
+// one the CPU supports (KERNEL_ISA=<isa> overrides the choice).
+
+// arguments of the engagement of one leader's followers with its enemies
+struct engage_args {
+	int ne;                      // number of enemies
+	const compute_t *ex,*ey,*ez,*em; // enemy positions and masses
+	compute_t *dfx,*dfy,*dfz,*drm; // defender side accumulators per enemy
+	compute_t r0, ka, kd;        // attack radius and constants
+	compute_t fight_radius, fight_rate, ratio, desert_rm;
+};
+
+struct engage_result {
+	compute_t fx,fy,fz,rm;       // attacker side
+	int win;                     // index of the last winning defender, -1 for none
+	int fights;
+};
+
+struct kernels {
+	const char *isa;
+	// coulomb repulsion of all pairs i<j in the tile [i0,i1)x[j0,j1)
+	// pos holds x,y,z,has_leader and acc fx,fy,fz,ep per insect
+	void (*coulomb_tile)(int i0, int i1, int j0, int j1, const compute_t *pos, compute_t *acc, compute_t D, compute_t r0);
+	// one attacker engages all enemies
+	void (*engage)(const struct engage_args *a, compute_t xa, compute_t ya, compute_t za, compute_t ma, struct engage_result *r);
+};
+
+extern struct kernels kernels;
+
+void setup_kernels();
+
+#endif
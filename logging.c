@@ -3,46 +3,240 @@
 
 #include <math.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <float.h>
 
 #include "model.h"
 #include "support.h"
 #include "logging.h"
+#include "enemies.h"
+#include "analysis.h"
+#include "devicedata.h"
+#include "kernels.h"
+#include "journal.h"
+#include "output.h"
 
 
-FILE* fp_log;
-FILE* fp_log_leaders;
-FILE* fp_log_timings;
+struct log_files log_files;
+int log_analyses_registered=0;
 
 void setup_logging() {
       char filename[4096];
       sprintf(filename,"%s/log.txt",params.output_dir);
-      fp_log=fopen(filename, "w+");
+      log_files.log=output_fopen(filename);
       sprintf(filename,"%s/log-leaders.txt",params.output_dir);
-      fp_log_leaders=fopen(filename, "w+");
+      log_files.leaders=output_fopen(filename);
       sprintf(filename,"%s/log-timings.txt",params.output_dir);
-      fp_log_timings=fopen(filename, "w+");
+      log_files.timings=output_fopen(filename);
+      fprintf(log_files.timings,"# kernel isa: %s\n",kernels.isa);
+      fprintf(log_files.timings,"# precision: %s, %d bytes per insect\n",PRECISION_NAME,(int)sizeof(struct insect_data));
+      sprintf(filename,"%s/log-balance.txt",params.output_dir);
+      log_files.balance=output_fopen(filename);
+      sprintf(filename,"%s/log-memory.txt",params.output_dir);
+      log_files.memory=output_fopen(filename);
+      log_files.journal=NULL;
+      if (params.journal) {
+	      sprintf(filename,"%s/journal.bin",params.output_dir);
+	      log_files.journal=output_fopen(filename);
+	      journal_snapshot(log_files.journal);
+      }
+      if (!log_analyses_registered) {
+	      register_log_analyses();
+	      log_analyses_registered=1;
+      }
 }
 
 void done_logging() {
-      fclose(fp_log);
-      fclose(fp_log_leaders);
-      fclose(fp_log_timings);
+      fclose(log_files.log);
+      fclose(log_files.leaders);
+      fclose(log_files.timings);
+      fclose(log_files.balance);
+      fclose(log_files.memory);
+      if (log_files.journal)
+	      fclose(log_files.journal);
 }
 
-void print_leaders(FILE* f, int iteration) {
-	if (iteration==0) {
+void log_record_init(struct log_record *r) {
+	r->iteration=-1;
+	r->num_leaders=0;
+	r->leader_counts=mem_malloc(MEM_ANALYSIS,MAX_NUM_LEADERS*sizeof(int));
+	r->num_sections=0;
+	r->nparts=0;
+	r->busy=NULL;
+	r->idle=NULL;
+}
+
+void log_record_section(struct log_record *r, const char *name) {
+	//keep this iteration's timing of the section with the record
+	int i=section_indexOf(name);
+	if (i<0 || r->num_sections==MAX_LOG_SECTIONS) return;
+	r->sections[r->num_sections++]=sections[i];
+	section_next_iteration(i);
+}
+
+// leader populations
+struct leaders_analysis {
+	int iteration;
+	int num_leaders;
+	int counts[MAX_NUM_LEADERS];     // insects per leader
+} leaders_analysis;
+
+void leaders_begin(void *state, int iteration) {
+	struct leaders_analysis *l=state;
+	l->iteration=iteration;
+	l->num_leaders=NumLeaders;
+}
+
+void leaders_visit(void *state, void *partial, const struct analysis_view *v) {
+	//the insects following a leader are the leader's subtree
+	int *counts=partial;
+	for (int i=v->begin;i<v->end;i++) {
+		int leader_id=v->insects[i].leader_id;
+		if (leader_id>=0)
+			counts[leader_id]++;
+	}
+}
+
+void leaders_end(void *state, int iteration, const void *partials, int num_blocks) {
+	struct leaders_analysis *l=state;
+	const int (*counts)[MAX_NUM_LEADERS]=partials;
+	for (int k=0;k<l->num_leaders;k++) {
+		l->counts[k]=0;
+		for (int b=0;b<num_blocks;b++)
+			l->counts[k]+=counts[b][k];
+	}
+}
+
+// centre of mass and energies
+struct energy_partial {
+	accum_t mx,my,mz,mvx,mvy,mvz,m;
+	accum_t kinetic, potential;
+};
+
+struct energy_analysis {
+	int iteration;
+	struct insect_data_double cms;
+	double kinetic_energy, potential_energy;
+} energy_analysis;
+
+void energy_visit(void *state, void *partial, const struct analysis_view *v) {
+	struct energy_partial *e=partial;
+	for (int i=v->begin;i<v->end;i++) {
+		const struct insect_data* p=&v->insects[i];
+		e->mx +=p->x *p->m;
+		e->my +=p->y *p->m;
+		e->mz +=p->z *p->m;
+		e->mvx+=p->vx*p->m;
+		e->mvy+=p->vy*p->m;
+		e->mvz+=p->vz*p->m;
+		e->m  +=p->m;
+		e->kinetic+=0.5*p->m*(p->vx*p->vx+p->vy*p->vy+p->vz*p->vz);
+		e->potential+=v->actions[i].ep+v->slow_actions[i].ep;
+	}
+}
+
+void energy_visit_device(void *state, void *partials, int num_blocks) {
+	//energy_visit() of all blocks on the target, from the device arrays
+	device_need_on_target(DEVICE_ACTIONS);
+	device_need_on_target(DEVICE_FORCES);
+	const storage_t *pos=device_array_data(DEVICE_POSITIONS);
+	const velocity_t *vel=device_array_data(DEVICE_VELOCITIES);
+	const compute_t *act=device_array_data(DEVICE_ACTIONS);
+	const compute_t *slow=device_array_data(DEVICE_FORCES);
+	struct energy_partial *e=partials;
+	int n=NumInsects;
+	#pragma omp target teams distribute parallel for map(alloc: pos[0:4*n], vel[0:4*n], act[0:4*n], slow[0:4*n]) map(from: e[0:num_blocks])
+	for (int b=0;b<num_blocks;b++) {
+		struct energy_partial s={0};
+		for (int i=b*ANALYSIS_BLOCK;i<MIN(n,(b+1)*ANALYSIS_BLOCK);i++) {
+			const storage_t *p=&pos[4*i];
+			const velocity_t *v=&vel[4*i];
+			s.mx +=p[0]*p[3];
+			s.my +=p[1]*p[3];
+			s.mz +=p[2]*p[3];
+			s.mvx+=v[0]*p[3];
+			s.mvy+=v[1]*p[3];
+			s.mvz+=v[2]*p[3];
+			s.m  +=p[3];
+			s.kinetic+=0.5*p[3]*(v[0]*v[0]+v[1]*v[1]+v[2]*v[2]);
+			s.potential+=act[4*i+3]+slow[4*i+3];
+		}
+		e[b]=s;
+	}
+	COUNT(COUNTER_DEVICE_BYTES_FROM,num_blocks*sizeof(*e));
+}
+
+void energy_end(void *state, int iteration, const void *partials, int num_blocks) {
+	struct energy_analysis *en=state;
+	const struct energy_partial *e=partials;
+	struct energy_partial sum={0};
+	for (int b=0;b<num_blocks;b++) {
+		sum.mx +=e[b].mx;
+		sum.my +=e[b].my;
+		sum.mz +=e[b].mz;
+		sum.mvx+=e[b].mvx;
+		sum.mvy+=e[b].mvy;
+		sum.mvz+=e[b].mvz;
+		sum.m  +=e[b].m;
+		sum.kinetic+=e[b].kinetic;
+		sum.potential+=e[b].potential;
+	}
+	struct insect_data_double cms={0};
+	cms.x =sum.mx /sum.m;
+	cms.y =sum.my /sum.m;
+	cms.z =sum.mz /sum.m;
+	cms.vx=sum.mvx/sum.m;
+	cms.vy=sum.mvy/sum.m;
+	cms.vz=sum.mvz/sum.m;
+	cms.m =sum.m;
+	en->iteration=iteration;
+	en->cms=cms;
+	en->kinetic_energy=sum.kinetic;
+	en->potential_energy=sum.potential;
+}
+
+void register_log_analyses() {
+	struct analysis a={0};
+	a.name="leaders";
+	a.period=1;
+	a.partial_size=MAX_NUM_LEADERS*sizeof(int);
+	a.state=&leaders_analysis;
+	a.begin=leaders_begin;
+	a.visit_block=leaders_visit;
+	a.end=leaders_end;
+	analysis_register(&a);
+
+	a.name="energy";
+	a.period=1;
+	a.partial_size=sizeof(struct energy_partial);
+	a.state=&energy_analysis;
+	a.begin=NULL;
+	a.visit_block=energy_visit;
+	a.visit_device=energy_visit_device;
+	a.end=energy_end;
+	analysis_register(&a);
+}
+
+void collect_balance(struct log_record *r, struct balance *b) {
+	if (r->nparts!=b->nparts) {
+		r->nparts=b->nparts;
+		r->busy=mem_realloc(MEM_ANALYSIS,r->busy,b->nparts*sizeof(double));
+		r->idle=mem_realloc(MEM_ANALYSIS,r->idle,b->nparts*sizeof(double));
+	}
+	for (int k=0;k<b->nparts;k++) {
+		r->busy[k]=b->busy[k];
+		r->idle[k]=b->idle[k];
+	}
+}
+
+void print_leaders(FILE* f, struct log_record *r) {
+	if (r->iteration==0) {
 		fprintf(f,"# iteration [insect_counts]\n");
 	}
-	int leader_idx, n, ntot=0;
-	fprintf(f,"%i ",iteration);
-	for (int i=0;i<NumLeaders;i++) {
-		leader_idx=leaders[i].insect_idx;
-		int leader_id=i;
-		n=1+count_children(leader_idx);
-		fprintf(f," %d",n);
-		ntot+=n;
+	fprintf(f,"%i ",r->iteration);
+	for (int i=0;i<r->num_leaders;i++) {
+		fprintf(f," %d",r->leader_counts[i]);
 	}
 	fprintf(f,"\n");
 }
@@ -70,33 +264,88 @@ int replacechar(char *str, char orig, char rep) {
     return n;
 }
 
-void print_timings(FILE *f,int iteration) {
+void print_timings(FILE *f, struct log_record *r) {
 	char nn[4096];
-	if (iteration==0) {
+	if (r->iteration==0) {
 		fprintf(f,"# iteration");
-		for (int i=0;i<num_sections;i++) {
-			strcpy(nn,sections[i].name);
-			if (strcmp(nn,"model")==0 || strcmp(nn,"image")==0) {
-				replacechar(nn,' ','_');
-				fprintf(f," %s.count %s.time %s.count_total %s.time_total",nn,nn,nn,nn);
-			}
+		for (int i=0;i<r->num_sections;i++) {
+			strcpy(nn,r->sections[i].name);
+			replacechar(nn,' ','_');
+			fprintf(f," %s.count %s.time %s.count_total %s.time_total",nn,nn,nn,nn);
 		}
+		for (int c=0;c<NUM_COUNTERS;c++)
+			fprintf(f," %s",counter_names[c]);
 		fprintf(f,"\n");
 	}
-	fprintf(f,"%3d ",iteration);
-	for (int i=0;i<num_sections;i++) {
-		const char *n=sections[i].name;
-		if (strcmp(n,"model")==0 || strcmp(n,"image")==0) {
-			fprintf(f,"%2d %e %2d %e ",sections[i].count_iteration, sections[i].total_iteration, sections[i].count, sections[i].total);
-		}
+	fprintf(f,"%3d ",r->iteration);
+	for (int i=0;i<r->num_sections;i++) {
+		struct section *s=&r->sections[i];
+		fprintf(f,"%2d %e %2d %e ",s->count_iteration, s->total_iteration, s->count, s->total);
 	}
+	for (int c=0;c<NUM_COUNTERS;c++)
+		fprintf(f," %lld",r->counters[c]);
 	fprintf(f,"\n");
 }
 
-void log_iteration(int iteration) {
-	print_leaders(fp_log_leaders,iteration);
-	print_timings(fp_log_timings,iteration);
-	sections_next_iteration();
+void print_balance(FILE *f, struct log_record *r) {
+	if (r->iteration==0) {
+		fprintf(f,"# iteration max_busy mean_busy mean_idle [idle_per_thread]\n");
+	}
+	if (r->nparts==0) return;
+	double max_busy=0, sum_busy=0, sum_idle=0;
+	for (int k=0;k<r->nparts;k++) {
+		max_busy=MAX(max_busy,r->busy[k]);
+		sum_busy+=r->busy[k];
+		sum_idle+=r->idle[k];
+	}
+	fprintf(f,"%3d %e %e %e ",r->iteration,max_busy,sum_busy/r->nparts,sum_idle/r->nparts);
+	for (int k=0;k<r->nparts;k++)
+		fprintf(f," %e",r->idle[k]);
+	fprintf(f,"\n");
+}
+
+void print_memory(FILE *f, struct log_record *r) {
+	//tracked bytes are process-wide, in an ensemble the members share them
+	struct mem_usage *u=&r->memory;
+	if (r->iteration==0) {
+		fprintf(f,"# iteration rss_kb peak_rss_kb total.bytes total.peak total.allocs");
+		for (int s=0;s<NUM_MEM_SUBSYSTEMS;s++)
+			fprintf(f," %s.bytes %s.peak %s.allocs",mem_subsystem_names[s],mem_subsystem_names[s],mem_subsystem_names[s]);
+		fprintf(f,"\n");
+	}
+	fprintf(f,"%3d %ld %ld ",r->iteration,u->rss_kb,u->peak_rss_kb);
+	fprintf(f," %lld %lld %lld",u->bytes[NUM_MEM_SUBSYSTEMS],u->peak[NUM_MEM_SUBSYSTEMS],u->allocs[NUM_MEM_SUBSYSTEMS]);
+	for (int s=0;s<NUM_MEM_SUBSYSTEMS;s++)
+		fprintf(f," %lld %lld %lld",u->bytes[s],u->peak[s],u->allocs[s]);
+	fprintf(f,"\n");
+}
+
+void log_collect(struct log_record *r, int iteration) {
+	//everything logged about an iteration is collected from the model state
+	//right away, the record is written later by log_write()
+	r->iteration=iteration;
+	r->files=log_files;
+	r->num_sections=0;
+	log_record_section(r,"model");
+	collect_balance(r,&enemies_balance);
+	counters_collect(r->counters);
+	mem_collect(&r->memory);
+	//the analyses ran as part of the iteration
+	r->num_leaders=leaders_analysis.num_leaders;
+	memcpy(r->leader_counts,leaders_analysis.counts,r->num_leaders*sizeof(int));
+	r->cms=energy_analysis.cms;
+	r->kinetic_energy=energy_analysis.kinetic_energy;
+	r->potential_energy=energy_analysis.potential_energy;
+}
+
+void log_write(struct log_record *r) {
+	int iteration=r->iteration;
+	//the record's files, the current model may have changed in the meantime
+	FILE *fp_log=r->files.log;
+	print_leaders(r->files.leaders,r);
+	print_timings(r->files.timings,r);
+	print_balance(r->files.balance,r);
+	print_memory(r->files.memory,r);
 	FILE *f=fp_log;
 	if (iteration==0) {
 		fprintf(f,"# iteration");
@@ -104,52 +353,24 @@ void log_iteration(int iteration) {
 		//fprintf(f," max_force_x max_force_y max_force_z");
 		//fprintf(f," total_force_x total_force_y total_force_z");
 		fprintf(f," cms_x cms_y cms_z cms_vy cms_vy cms_vz mass");
-		fprintf(f," kinetic_energy");
+		fprintf(f," kinetic_energy potential_energy total_energy");
 		fprintf(f,"\n");
 	}
-	struct insect_data_double cms={0};
-	struct insect_action_data sum={0};
-	struct insect_action_data max={0};
-	float minm=+INFINITY;
-	float maxm=-INFINITY;
-	double E=0;
-	for (int i=0;i<NumInsects;i++) {
-		struct insect_action_data* a=&actions[i];
-		struct insect_data* p=&insects[i];
-		sum.fx+=a->fx;
-		sum.fy+=a->fy;
-		sum.fz+=a->fz;
-		max.fx=MAX(max.fx,a->fx);
-		max.fy=MAX(max.fy,a->fy);
-		max.fz=MAX(max.fz,a->fz);
-		minm=MIN(minm,p->m);
-		maxm=MAX(maxm,p->m);
-		cms.x +=p->x *p->m;
-		cms.y +=p->y *p->m;
-		cms.z +=p->z *p->m;
-		cms.vx+=p->vx*p->m;
-		cms.vy+=p->vy*p->m;
-		cms.vz+=p->vz*p->m;
-		E+=0.5*p->m*(p->vx*p->vx+p->vy*p->vy+p->vz*p->vz);
-		cms.m+=p->m;
-	}
 	//fprintf(fp_log," %e %e ",minm,maxm);
 	//fprint_insect_action_data(fp_log,&max);
 	//fprintf(fp_log," ");
 	//fprint_insect_action_data(fp_log,&sum);
 	fprintf(fp_log," %4d ",iteration);
-	cms.x /=cms.m;
-	cms.y /=cms.m;
-	cms.z /=cms.m;
-	cms.vx/=cms.m;
-	cms.vy/=cms.m;
-	cms.vz/=cms.m;
-	fprint_insect_data_double(fp_log,&cms);
+	fprint_insect_data_double(fp_log,&r->cms);
+	double E=r->kinetic_energy, Ep=r->potential_energy;
 	fprintf(fp_log," %.*le",DECIMAL_DIG,E);
+	fprintf(fp_log," %.*le %.*le",DECIMAL_DIG,Ep,DECIMAL_DIG,E+Ep);
 	fprintf(fp_log,"\n");
 	fflush(fp_log);
-	fflush(fp_log_leaders);
-	fflush(fp_log_timings);
+	fflush(r->files.leaders);
+	fflush(r->files.timings);
+	fflush(r->files.balance);
+	fflush(r->files.memory);
 	printf("iteration %d\n",iteration);
 }
 
@@ -158,7 +379,7 @@ void fprint_insect_data_double(FILE* stream, struct insect_data_double* p) {
 }
 
 void fprint_insect_data(FILE* stream, struct insect_data* p) {
-	fprintf(stream,"%+.*e %+.*e %+.*e %+.*e %+.*e %+.*e %.*e",DECIMAL_DIG,p->x,DECIMAL_DIG,p->y,DECIMAL_DIG,p->z,DECIMAL_DIG,p->vx,DECIMAL_DIG,p->vy,DECIMAL_DIG,p->vz, DECIMAL_DIG,p->m);
+	fprintf(stream,"%+.*e %+.*e %+.*e %+.*e %+.*e %+.*e %.*e",DECIMAL_DIG,(double)p->x,DECIMAL_DIG,(double)p->y,DECIMAL_DIG,(double)p->z,DECIMAL_DIG,(double)p->vx,DECIMAL_DIG,(double)p->vy,DECIMAL_DIG,(double)p->vz, DECIMAL_DIG,(double)p->m);
 }
 
 void print_insect_data(struct insect_data* p) {
@@ -170,17 +391,17 @@ void print_insect_action_data(struct insect_action_data* p) {
 }
 
 void fprint_insect_action_data(FILE *stream,struct insect_action_data* p) {
-	fprintf(stream,"%+.*e %+.*e %+.*e",DECIMAL_DIG,p->fx,DECIMAL_DIG,p->fy,DECIMAL_DIG,p->fz);
+	fprintf(stream,"%+.*e %+.*e %+.*e",DECIMAL_DIG,(double)p->fx,DECIMAL_DIG,(double)p->fy,DECIMAL_DIG,(double)p->fz);
 }
 
 void print_model(int i, struct insect_data* p,struct insect_action_data* a) {
-	printf("%d %+.9e %+.9e %+.9e  %+.9e %+.9e %+.9e  %+.9e %+.9e\n",i, p->x,p->y,p->z,p->vx,p->vy,p->vz,a->fx,a->fy,a->fz);
+	printf("%d %+.9e %+.9e %+.9e  %+.9e %+.9e %+.9e  %+.9e %+.9e\n",i, (double)p->x,(double)p->y,(double)p->z,(double)p->vx,(double)p->vy,(double)p->vz,(double)a->fx,(double)a->fy,(double)a->fz);
 }
 
 void print_p(int i) {
 	struct insect_data* p=&insects[i];
 	struct insect_action_data* a=&actions[i];
-	printf("%d %+.9e %+.9e %+.9e  %+.9e %+.9e %+.9e  %+.9e %+.9e\n",i, p->x,p->y,p->z,p->vx,p->vy,p->vz,a->fx,a->fy,a->fz);
+	printf("%d %+.9e %+.9e %+.9e  %+.9e %+.9e %+.9e  %+.9e %+.9e\n",i, (double)p->x,(double)p->y,(double)p->z,(double)p->vx,(double)p->vy,(double)p->vz,(double)a->fx,(double)a->fy,(double)a->fz);
 }
 
 
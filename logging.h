@@ -1,7 +1,41 @@
+#ifndef LOGGING_H_INCLUDED
+#define LOGGING_H_INCLUDED
+
 #include "model.h"
 #include <stdio.h>
 
-void print_leaders(FILE* f, int iteration);
+#include "balance.h"
+#include "support.h"
+
+#define MAX_LOG_SECTIONS 8
+
+// the log files of a model
+struct log_files {
+	FILE *log, *leaders, *timings, *balance, *memory;
+	FILE *journal;               // NULL without JOURNAL
+};
+
+extern struct log_files log_files;
+
+// everything written to the logs about one iteration
+struct log_record {
+	int iteration;
+	struct log_files files;      // where the record goes
+	int num_leaders;
+	int *leader_counts;          // insects per leader
+	struct insect_data_double cms;
+	double kinetic_energy, potential_energy;
+	int num_sections;
+	struct section sections[MAX_LOG_SECTIONS];
+	int nparts;
+	double *busy, *idle;         // load balance of the enemy loop
+	long long counters[NUM_COUNTERS];
+	struct mem_usage memory;
+};
+
+void log_record_init(struct log_record *r);
+void log_record_section(struct log_record *r, const char *name);
+void print_leaders(FILE* f, struct log_record *r);
 void print_parent_chain(int p_idx);
 void fprint_insect_data(FILE* stream, struct insect_data* p);
 void fprint_insect_data_double(FILE* stream, struct insect_data_double* p);
@@ -10,6 +44,12 @@ void print_insect_action_data(struct insect_action_data* p);
 void fprint_insect_action_data(FILE* stream, struct insect_action_data* p);
 void print_model(int i, struct insect_data* p,struct insect_action_data* a);
 void print_p(int i);
-void log_iteration(int iteration);
+void print_balance(FILE *f, struct log_record *r);
+void print_memory(FILE *f, struct log_record *r);
+void log_collect(struct log_record *r, int iteration);
+void log_write(struct log_record *r);
+void register_log_analyses();
 void setup_logging();
 void done_logging();
+
+#endif
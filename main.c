@@ -1,23 +1,112 @@
+#include <stdlib.h>
+
 #include "main.h"
 #include "support.h"
 #include "model.h"
 #include "render.h"
 #include "logging.h"
+#include "frame.h"
+#include "shmframes.h"
+#include "validate.h"
+#include "kernels.h"
+#include "ensemble.h"
+#include "ranks.h"
+#include "devicedata.h"
+#include "output.h"
+
+struct output_slot output_slots[NUM_OUTPUT_SLOTS];
+
+// frames published to an external viewer
+#define NUM_SHM_FRAMES 4
+struct shm_frames shm_frames;
+
+struct render_policy render_policy;
 
 void main(void)
 {
+      setup_ranks();
       setup_devices();
+      setup_kernels();
+      setup_output();
+      if (getenv("ENSEMBLE")) {
+	      if (mpi_size>1) {
+		      printf("ENSEMBLE does not run on several ranks\n");
+		      exit(-1);
+	      }
+	      run_ensemble(getenv("ENSEMBLE"));
+	      done_output();
+	      return;
+      }
       setup_model();
-      setup_logging();
-
-      params.num_iterations=4096;
+      //all ranks advance the same model, rank 0 writes the output
+      int output=(mpi_rank==0);
+      if (!output) {
+	      params.render=0;
+	      params.frame_shm=NULL;
+	      params.validate=0;
+      }
+      if (output)
+	      setup_logging();
+      for (int k=0;k<NUM_OUTPUT_SLOTS;k++) {
+	      frame_init(&output_slots[k].frame,NumInsects);
+	      log_record_init(&output_slots[k].log);
+      }
+      if (params.frame_shm && shm_frames_create(&shm_frames,params.frame_shm,NUM_SHM_FRAMES,NumInsects,MAX_NUM_LEADERS)!=0) {
+	      printf("cannot create shared memory frames %s\n",params.frame_shm);
+	      exit(-1);
+      }
+      if (params.device)
+	      setup_device_data();
+      if (params.validate)
+	      setup_validation();
+      if (params.render)
+	      render_policy_init(&render_policy,&params);
+      int image_chain, log_chain, shm_chain;
+      #pragma omp parallel
+      #pragma omp single
       for (int i=0;i<params.num_iterations;i++) {
-	      if (i==200)
+	      if (i==params.rivalism_iteration)
 		      model_enable_rivalism();
-	      iteration();
-	      save_image(i);
-	      log_iteration(i);
+	      struct output_slot *slot=&output_slots[i%NUM_OUTPUT_SLOTS];
+	      //wait for the slot's previous frame to be rendered and logged
+	      #pragma omp taskwait depend(inout: slot->frame)
+	      if (params.validate)
+		      validate_reference_step(i);
+	      //the iteration captures the frame in its last pass, if it is
+	      //rendered or published
+	      float scale=params.render?render_due(&render_policy,i):0;
+	      iteration((scale>0 || params.frame_shm)?&slot->frame:NULL);
+	      if (output)
+		      log_collect(&slot->log,i);
+	      if (params.validate)
+		      validate_compare(i);
+	      if (params.frame_shm) {
+		      #pragma omp task depend(in: slot->frame) depend(inout: shm_chain)
+		      shm_frames_publish(&shm_frames,&slot->frame);
+	      }
+	      if (scale>0) {
+		      #pragma omp task depend(inout: slot->frame) depend(inout: image_chain)
+		      {
+			      render_policy_frame(&render_policy,&slot->frame,scale);
+			      log_record_section(&slot->log,"image");
+		      }
+	      }
+	      if (output) {
+		      #pragma omp task depend(in: slot->frame) depend(inout: log_chain)
+		      log_write(&slot->log);
+	      }
       }
-      done_logging();
+      if (params.frame_shm) {
+	      shm_frames_finish(&shm_frames);
+	      shm_frames_destroy(&shm_frames,params.frame_shm);
+      }
+      if (params.validate)
+	      done_validation();
+      done_device_data();
+      if (params.render)
+	      render_policy_done(&render_policy,params.num_iterations);
+      if (output)
+	      done_logging();
+      done_output();
+      done_ranks();
 }
-
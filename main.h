@@ -0,0 +1,17 @@
+#ifndef MAIN_H
+#define MAIN_H
+
+#include "frame.h"
+#include "logging.h"
+
+// output of one iteration: the frame to render and the record to log
+struct output_slot {
+	struct frame frame;
+	struct log_record log;
+};
+
+// rendering and logging of an iteration overlap with the next iterations,
+// up to NUM_OUTPUT_SLOTS iterations can be in flight
+#define NUM_OUTPUT_SLOTS 3
+
+#endif
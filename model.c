@@ -2,10 +2,20 @@
 #include <memory.h>
 #include <math.h>
 #include <signal.h>
+#include <stddef.h>
+#include <string.h>
 
 #include "model.h"
 #include "support.h"
 #include "logging.h"
+#include "enemies.h"
+#include "pm.h"
+#include "analysis.h"
+#include "frame.h"
+#include "kernels.h"
+#include "ranks.h"
+#include "devicedata.h"
+#include "journal.h"
 
 int NumInsects;
 int NumLeaders;
@@ -15,69 +25,198 @@ struct leader_data *leaders;
 
 struct insect_data *insects;
 struct insect_action_data *actions;
+struct insect_action_data *slow_actions;
+struct insect_action_data *enemy_actions;
 
-float distance(int a, int b) {
-	float dx,dy,dz,r;
-	dx=insects[a].x-insects[b].x;
-	dy=insects[a].y-insects[b].y;
-	dz=insects[a].z-insects[b].z;
-	r=sqrt(dx*dx+dy*dy+dz*dz);
-	return r;
-}
+//multiple time stepping: the slow forces are (re)evaluated on every
+//respa_interval-th step and applied as an impulse of respa_interval*dt
+int model_step=0;
+int respa_slow_step=0;
 
-int relevant_enemy(int leader, int target) {
-	return (distance(leader, target)<=params.attack_radius) && (insects[target].leader_idx>=0);
-}
+//block time steps: insect i is kicked on the steps that are multiples of
+//2^step_level[i], with the impulse of its forces at the kick over the steps
+//since its last kick, and drifts on every step. The forces are evaluated for
+//the insects kicked on a step only, the mass transfers of the fights for
+//both opponents on every step they are evaluated
+unsigned char *step_level;
+unsigned char *sync_pending; // back to the base step after this step
+int *last_kick;
 
-void repell_pair(int target, int partner) {
+//interaction terms enabled, and the fast force kernel specialized for them
+int force_terms=-1;
+void (*fast_forces)();
+
+void repell_pair(int target, int partner, struct insect_action_data *out) {
 	//repell using capped coulomb force
-	float dx,dy,dz,r,a,b,c,fx,fy,fz;
-	float D=params.coulomb_constant;
+	compute_t dx,dy,dz,r,rr,a,b,c,fx,fy,fz;
+	compute_t D=params.coulomb_constant;
 	if (partner==target) return;
 	dx=insects[target].x-insects[partner].x;
 	dy=insects[target].y-insects[partner].y;
 	dz=insects[target].z-insects[partner].z;
 	r=sqrt(dx*dx+dy*dy+dz*dz);
-	float r0=params.coulomb_radius;
-	if (r<r0) r=r0;
-	a  = D/(r*r*r);
+	compute_t r0=params.coulomb_radius;
+	rr=r;
+	if (rr<r0) rr=r0;
+	a  = D/(rr*rr*rr);
 	fx = dx*a;
 	fy = dy*a;
 	fz = dz*a;
-	actions[target].fx+=fx;
-	actions[target].fy+=fy;
-	actions[target].fz+=fz;
+	out[target].fx+=fx;
+	out[target].fy+=fy;
+	out[target].fz+=fz;
+	//half of the pair potential, the partner accounts for the other half
+	out[target].ep+=0.5*a*(1.5*rr*rr-0.5*r*r);
 /* don't apply force to partner since it will calculate this by itself
-	actions[partner].fx-=fx;
-	actions[partner].fy-=fy;
-	actions[partner].fz-=fz;
+	out[partner].fx-=fx;
+	out[partner].fy-=fy;
+	out[partner].fz-=fz;
 */
 }
 
-void coulomb_repell(int i) {
+void coulomb_repell(int i, struct insect_action_data *out) {
+	if (insects[i].leader_idx<0) return;
 	for (int partner=0; partner < NumInsects; partner++) {
-		if (insects[i].leader_idx>=0)
-			repell_pair(i,partner);
+		repell_pair(i,partner,out);
 	}
+	COUNT(COUNTER_COULOMB_PAIRS,NumInsects);
 }
 
-void identify_leaders(int leader_layer) {
-	NumLeaders=0;
-	for (int i=0;i<NumInsects;i++) {
-		int layer=0;
-		int idx=i;
-		while (idx>=0) {layer++; idx=insects[idx].parent;}
-		if (layer==leader_layer) {
-			if (NumLeaders==MAX_NUM_LEADERS) 
-				exit(-1);
-			int leader=NumLeaders++;
-			leaders[leader].insect_idx=i;
+//half-pair evaluation: each pair i<j is computed once and the reaction is
+//applied to j. Pairs are processed in square tiles. The tile pairs are split
+//into COULOMB_SLOTS contiguous ranges, each accumulated in order into its own
+//buffer, and the buffers are reduced in order, so the sums depend neither on
+//the schedule nor on the number of threads
+#define COULOMB_TILE 256
+#define COULOMB_SLOTS 32
+
+compute_t *coulomb_pos;   // x,y,z,has_leader per insect
+compute_t *coulomb_acc;   // fx,fy,fz,ep per slot and insect
+int *coulomb_order;       // active insects first, for coulomb_repell_active()
+
+struct coulomb_batch coulomb_batch_of_model(struct insect_action_data *out) {
+	//the half-pair evaluation of the current model into out
+	int n=NumInsects;
+	if (coulomb_pos==NULL) {
+		coulomb_pos=mem_malloc(MEM_FORCES,4*n*sizeof(compute_t));
+		coulomb_acc=mem_malloc(MEM_FORCES,(size_t)COULOMB_SLOTS*4*n*sizeof(compute_t));
+	}
+	struct coulomb_batch b;
+	b.n=n;
+	b.insects=insects;
+	b.out=out;
+	b.pos=coulomb_pos;
+	b.acc=coulomb_acc;
+	b.D=params.coulomb_constant;
+	b.r0=params.coulomb_radius;
+	int ntiles=(n+COULOMB_TILE-1)/COULOMB_TILE;
+	b.p0=0;
+	b.p1=(long long)ntiles*(ntiles+1)/2;
+	return b;
+}
+
+static void coulomb_slot(struct coulomb_batch *b, int s) {
+	//the tile pairs (I,J), I<=J, of slot s, enumerated row by row
+	int n=b->n;
+	int ntiles=(n+COULOMB_TILE-1)/COULOMB_TILE;
+	compute_t *acc=&b->acc[(size_t)s*4*n];
+	memset(acc,0,4*n*sizeof(compute_t));
+	long long p0=b->p0+(b->p1-b->p0)*s/COULOMB_SLOTS;
+	long long p1=b->p0+(b->p1-b->p0)*(s+1)/COULOMB_SLOTS;
+	if (p0==p1) return;
+	int I=0, row=ntiles;
+	long long q=p0;
+	while (q>=row) {q-=row; row--; I++;}
+	int J=I+q;
+	long long pairs=0;
+	for (long long p=p0;p<p1;p++) {
+		int ni=MIN((I+1)*COULOMB_TILE,n)-I*COULOMB_TILE;
+		int nj=MIN((J+1)*COULOMB_TILE,n)-J*COULOMB_TILE;
+		pairs+=I<J ? (long long)ni*nj : (long long)ni*(ni-1)/2;
+		kernels.coulomb_tile(I*COULOMB_TILE,MIN((I+1)*COULOMB_TILE,n),J*COULOMB_TILE,MIN((J+1)*COULOMB_TILE,n),
+			b->pos,acc,b->D,b->r0);
+		if (++J==ntiles) {I++; J=I;}
+	}
+	COUNT(COUNTER_COULOMB_PAIRS,pairs);
+}
+
+static inline void coulomb_reduce(const struct coulomb_batch *b, int k, struct insect_action_data *out) {
+	//the slots' sums for the insect at position k, in slot order
+	for (int s=0;s<COULOMB_SLOTS;s++) {
+		const compute_t *a=&b->acc[(size_t)s*4*b->n+4*k];
+		out->fx+=a[0];
+		out->fy+=a[1];
+		out->fz+=a[2];
+		out->ep+=a[3];
+	}
+}
+
+void coulomb_half_pairs_batch(struct coulomb_batch *batch, int nb) {
+	//the slots of all systems are spread over the threads together
+	for (int m=0;m<nb;m++) {
+		struct coulomb_batch *b=&batch[m];
+		int n=b->n;
+		#pragma omp taskloop nogroup
+		for (int i=0;i<n;i++) {
+			b->pos[4*i]  =b->insects[i].x;
+			b->pos[4*i+1]=b->insects[i].y;
+			b->pos[4*i+2]=b->insects[i].z;
+			b->pos[4*i+3]=(b->insects[i].leader_idx>=0);
 		}
 	}
+	#pragma omp taskwait
+	#pragma omp taskloop grainsize(1)
+	for (int t=0;t<nb*COULOMB_SLOTS;t++)
+		coulomb_slot(&batch[t/COULOMB_SLOTS],t%COULOMB_SLOTS);
+	for (int m=0;m<nb;m++) {
+		struct coulomb_batch *b=&batch[m];
+		#pragma omp taskloop nogroup
+		for (int i=0;i<b->n;i++)
+			coulomb_reduce(b,i,&b->out[i]);
+	}
+	#pragma omp taskwait
+}
 
-	for (int i=0;i<NumLeaders;i++) {
-		leaders[i].id=i;
-		leaders[i].hue=1.0*(1+i)/(NumLeaders+1);
+void coulomb_repell_half_pairs(struct insect_action_data *out) {
+	struct coulomb_batch b=coulomb_batch_of_model(out);
+	coulomb_half_pairs_batch(&b,1);
+}
+
+void coulomb_repell_active(struct insect_action_data *out) {
+	//block time steps: the half-pair evaluation for the insects kicked on
+	//this step only. They are packed to the front, and the tile pairs (I,J)
+	//with I<=J and I in the front tiles hold every pair with an active
+	//insect, the pairs of two active insects once
+	struct coulomb_batch b=coulomb_batch_of_model(out);
+	int n=b.n;
+	if (coulomb_order==NULL)
+		coulomb_order=mem_malloc(MEM_FORCES,n*sizeof(int));
+	int na=0;
+	for (int i=0;i<n;i++)
+		if (step_active(i)) coulomb_order[na++]=i;
+	if (na==0) return;
+	int j=na;
+	for (int i=0;i<n;i++)
+		if (!step_active(i)) coulomb_order[j++]=i;
+	#pragma omp taskloop
+	for (int k=0;k<n;k++) {
+		int i=coulomb_order[k];
+		b.pos[4*k]  =insects[i].x;
+		b.pos[4*k+1]=insects[i].y;
+		b.pos[4*k+2]=insects[i].z;
+		b.pos[4*k+3]=(insects[i].leader_idx>=0);
+	}
+	int ntiles=(n+COULOMB_TILE-1)/COULOMB_TILE;
+	int nactive=(na+COULOMB_TILE-1)/COULOMB_TILE;
+	b.p1=(long long)nactive*ntiles-(long long)nactive*(nactive-1)/2;
+	#pragma omp taskloop grainsize(1)
+	for (int s=0;s<COULOMB_SLOTS;s++)
+		coulomb_slot(&b,s);
+	#pragma omp taskloop
+	for (int k=0;k<na;k++) {
+		int i=coulomb_order[k];
+		clear_action(&out[i]);
+		coulomb_reduce(&b,k,&out[i]);
 	}
 }
 
@@ -99,24 +238,6 @@ int make_leader(int idx, int leader_idx, int leader_id) {
 	return n;
 }
 
-double rand01() {
-	return ((double)rand())/RAND_MAX;
-}
-
-void make_leaders() {
-	int leader_idx, n;
-	for (int i=0;i<NumInsects;i++) {
-		insects[i].leader_id=-1;
-		insects[i].leader_idx=-1;
-	}
-
-	for (int i=0;i<NumLeaders;i++) {
-		leader_idx=leaders[i].insect_idx;
-		int leader_id=i;
-		n=make_leader(leader_idx,leader_idx,leader_id);
-	}
-}
-
 void params_small_case(struct model_parameters* params) {
 	params->lx=200;
 	params->ly=200;
@@ -145,12 +266,28 @@ void params_small_case(struct model_parameters* params) {
 	
 	params->center_force_constant=0.1;
 
+	params->respa_interval=MAX(1,getenvl("RESPA_INTERVAL",1));
+	params->block_step_levels=MIN(MAX_BLOCK_STEP_LEVELS,MAX(0,getenvl("BLOCK_STEP_LEVELS",0)));
+	params->block_step_eta=getenvd("BLOCK_STEP_ETA",0.2);
+	params->coulomb_half_pairs=getenvl("COULOMB_HALF_PAIRS",1);
+	params->pm_grid=getenvl("PM_GRID",0);
+
 	params->output_dir="out";
+	params->journal=getenvl("JOURNAL",0);
+	params->render=getenvl("RENDER",1);
+	params->render_every=MAX(1,getenvl("RENDER_EVERY",1));
+	params->render_scale=getenvd("RENDER_SCALE",1);
+	params->render_budget=getenvd("RENDER_BUDGET",0);
+	params->frame_shm=getenv("FRAME_SHM");
+	params->device=getenvl("DEVICE",0);
+	params->validate=getenvl("VALIDATE",0);
 
-	params->num_insects=10240;
-	params->max_tree_depth=7;
+	params->num_insects=getenvl("NUM_INSECTS",10240);
+	params->max_tree_depth=getenvl("MAX_TREE_DEPTH",7);
+	params->seed=getenvl("SEED",0);
 
-	params->num_iterations=getenvl("ITERATIONS",16);
+	params->num_iterations=getenvl("ITERATIONS",4096);
+	params->rivalism_iteration=getenvl("RIVALISM",200);
 }
 
 void params_large_case(struct model_parameters* params) {
@@ -181,12 +318,28 @@ void params_large_case(struct model_parameters* params) {
 	
 	params->center_force_constant=0.1;
 
+	params->respa_interval=MAX(1,getenvl("RESPA_INTERVAL",1));
+	params->block_step_levels=MIN(MAX_BLOCK_STEP_LEVELS,MAX(0,getenvl("BLOCK_STEP_LEVELS",0)));
+	params->block_step_eta=getenvd("BLOCK_STEP_ETA",0.2);
+	params->coulomb_half_pairs=getenvl("COULOMB_HALF_PAIRS",1);
+	params->pm_grid=getenvl("PM_GRID",0);
+
 	params->output_dir="out";
+	params->journal=getenvl("JOURNAL",0);
+	params->render=getenvl("RENDER",1);
+	params->render_every=MAX(1,getenvl("RENDER_EVERY",1));
+	params->render_scale=getenvd("RENDER_SCALE",1);
+	params->render_budget=getenvd("RENDER_BUDGET",0);
+	params->frame_shm=getenv("FRAME_SHM");
+	params->device=getenvl("DEVICE",0);
+	params->validate=getenvl("VALIDATE",0);
 
-	params->num_insects=1<<14;
-	params->max_tree_depth=9;
+	params->num_insects=getenvl("NUM_INSECTS",1<<14);
+	params->max_tree_depth=getenvl("MAX_TREE_DEPTH",9);
+	params->seed=getenvl("SEED",0);
 
-	params->num_iterations=getenvl("ITERATIONS",16);
+	params->num_iterations=getenvl("ITERATIONS",4096);
+	params->rivalism_iteration=getenvl("RIVALISM",200);
 }
 
 
@@ -199,162 +352,139 @@ void model_enable_rivalism() {
 	params.fight_mass_rate=0.01;
 }
 
-void setup_model() {
+#define TREE_ARITY 4
 
+long long tree_subtree_size(int level, int max_level) {
+	//number of insects in a full subtree whose root is at level
+	long long n=0, w=1;
+	for (int l=level;l<=max_level;l++) {
+		n+=w;
+		w*=TREE_ARITY;
+	}
+	return n;
+}
+
+void place_in_tree(int i, int max_level, int leader_level, const long long *subtree_size) {
+	//the tree is filled depth-first, so insect i is found by descending from the root
+	//and skipping over the full subtrees of the preceding siblings
+	struct insect_data *p=&insects[i];
+	int node=0, parent=-1, level=0;
+	int leader_idx=(leader_level==0)?0:-1;
+	while (node!=i) {
+		long long s=subtree_size[level+1];
+		int c=(i-node-1)/s;
+		parent=node;
+		node=node+1+c*s;
+		level++;
+		if (level==leader_level) leader_idx=node;
+	}
+	p->parent=parent;
+	p->leader_idx=leader_idx;
+	p->leader_id=-1;
+	p->nchildren=0;
+	if (level<max_level) {
+		for (int c=0;c<TREE_ARITY;c++) {
+			long long child=i+1+c*subtree_size[level+1];
+			if (child>=NumInsects) break;
+			p->children[p->nchildren++]=child;
+		}
+	}
+}
+
+void setup_params() {
 	params_small_case(&params);
 	//params_large_case(&params);
+}
+
+void setup_world() {
 	NumInsects=params.num_insects;
+	model_step=0;
+	respa_slow_step=0;
+	force_terms=-1;
+	fast_forces=NULL;
+	coulomb_pos=NULL;
+	coulomb_acc=NULL;
+	coulomb_order=NULL;
 
 	//setup insects
-	insects=malloc(NumInsects*sizeof(struct insect_data));
-	actions=malloc(NumInsects*sizeof(struct insect_action_data));
-	float x,y,z;
+	insects=mem_malloc(MEM_MODEL,NumInsects*sizeof(struct insect_data));
+	actions=mem_malloc(MEM_MODEL,NumInsects*sizeof(struct insect_action_data));
+	slow_actions=mem_malloc(MEM_MODEL,NumInsects*sizeof(struct insect_action_data));
+	enemy_actions=mem_malloc(MEM_MODEL,NumInsects*sizeof(struct insect_action_data));
+	clear_actions(slow_actions);
+	clear_actions(enemy_actions);
+	step_level=mem_calloc(MEM_MODEL,NumInsects,sizeof(unsigned char));
+	last_kick=mem_malloc(MEM_MODEL,NumInsects*sizeof(int));
+	for (int i=0;i<NumInsects;i++)
+		last_kick[i]=-1;
+	sync_pending=mem_calloc(MEM_MODEL,NumInsects,sizeof(unsigned char));
+	if (params.block_step_levels>0 && (params.respa_interval>1 || params.pm_grid>0
+		|| params.device || params.validate || mpi_size>1)) {
+		printf("BLOCK_STEP_LEVELS does not combine with RESPA_INTERVAL, PM_GRID, DEVICE, VALIDATE or several ranks, see README.md\n");
+		exit(-1);
+	}
 	float lx=params.lx,ly=params.ly,lz=params.lz;
 	float x0=-lx/2;
 	float y0=-ly/2;
 	float z0=-lz/2;
+	uint64_t seed=params.seed;
+
+	int max_level=params.max_tree_depth;
+	int leader_level=4;
+	long long subtree_size[max_level+2];
+	for (int l=0;l<=max_level+1;l++)
+		subtree_size[l]=tree_subtree_size(l,max_level);
+	if (NumInsects>subtree_size[0]) {
+		printf("tree full at insect %lld\n",subtree_size[0]);
+		exit(-1);
+	}
 
-	//x in -lx/2..+lx/2
+	//x in -lx/2..+lx/2, each insect draws from its own random stream
+	#pragma omp parallel for
 	for (int i=0;i<NumInsects;i++) {
-		x = x0+lx*rand01();
-		y = y0+ly*rand01();
-		z = z0+lz*rand01();
-		insects[i].x=x;
-		insects[i].y=y;
-		insects[i].z=z;
+		insects[i].x=x0+lx*rng_uniform01(seed,i,0);
+		insects[i].y=y0+ly*rng_uniform01(seed,i,1);
+		insects[i].z=z0+lz*rng_uniform01(seed,i,2);
 		insects[i].vx=0;
 		insects[i].vy=0;
 		insects[i].vz=0;
-		insects[i].m=1+rand01();
-		insects[i].parent=-2;
-		insects[i].leader_idx=-1;
-		insects[i].leader_id=-1;
-		insects[i].nchildren=0;
-	}
-	insects[0].parent=-1;
-	int current=0;
-	int target_nchildren=4;
-	int i=1;
-	int level=0;
-	int max_level=params.max_tree_depth;
-	while (i<NumInsects) {
-		if (insects[current].nchildren<target_nchildren&&level<max_level) {
-			//add i to current
-			int idx=insects[current].nchildren;
-			insects[current].children[idx]=i;
-			insects[current].nchildren=idx+1;
-			insects[i].parent=current;
-			//add upcoming insects to child i
-			current=i;
-			level++;
-			i++;
-		} else {
-			//filled, try adding to parent
-			current=insects[current].parent;
-			level--;
-			if (current==-1) {
-				printf("tree full at insect %d\n",i); 
-				exit(-1);
-			}
-		}
+		insects[i].m=1+rng_uniform01(seed,i,3);
+		place_in_tree(i,max_level,leader_level,subtree_size);
 	}
-	//setup leaders
-	leaders=malloc(MAX_NUM_LEADERS*sizeof(struct leader_data));
-	int leader_layer=5;
-	identify_leaders(leader_layer);
-	make_leaders();
-}
 
-void attack_defend_fight(int attack, int defend) {
-	float dx,dy,dz,r,a,d;
-	
-	if (attack<0||defend<0||attack==defend) return;
-	dx=insects[defend].x-insects[attack].x;
-	dy=insects[defend].y-insects[attack].y;
-	dz=insects[defend].z-insects[attack].z;
-	r=sqrt(dx*dx+dy*dy+dz*dz);
-	float r0=params.attack_radius;
-	float rr=r;
-	if (rr<r0) rr=r0;
-	a = params.attack_constant/(rr*rr*rr);
-	d = params.defend_constant/(rr*rr*rr);
-	actions[attack].fx+=dx*a;
-	actions[attack].fy+=dy*a;
-	actions[attack].fz+=dz*a;
-	actions[defend].fx+=dx*d;
-	actions[defend].fy+=dy*d;
-	actions[defend].fz+=dz*d;
-	if (r<params.fight_radius) {
-		float md=insects[defend].m;
-		float ma=insects[attack].m;
-		float ratio=params.surrender_mass_ratio;
-		if (ma/md>ratio) {
-			//attack wins
-			//actions[defend].new_parent=attack;
-			//actions[defend].rm+=.1/params.dt;
-		} else 	if (md/ma>ratio) {
-			//defend wins
-			actions[attack].new_parent=defend;
-			float rm=.1/params.dt;
-			actions[attack].rm+=rm;
-			actions[defend].rm-=rm;
-		} else {
-			//mass transfer to heavier one
-			float rm=params.fight_mass_rate*(ma-md)/(ma+md);
-			actions[defend].rm-=rm;
-			actions[attack].rm+=rm;
+	//setup leaders, numbered in order of their index
+	leaders=mem_malloc(MEM_MODEL,MAX_NUM_LEADERS*sizeof(struct leader_data));
+	NumLeaders=0;
+	for (int i=0;i<NumInsects;i++) {
+		if (insects[i].leader_idx==i) {
+			if (NumLeaders==MAX_NUM_LEADERS) 
+				exit(-1);
+			int leader=NumLeaders++;
+			leaders[leader].insect_idx=i;
+			insects[i].leader_id=leader;
 		}
 	}
-}
-
-
-int engage_descendants(int target_idx, int insect_idx, int leader_idx) {
-	//insect engages target and all of its descendants that are a relevant enemy to leader
-	int n=0;
-	//engage target
-	if (relevant_enemy(leader_idx,target_idx)) {
-		attack_defend_fight(insect_idx,target_idx);
-		n=1;
+	for (int i=0;i<NumLeaders;i++) {
+		leaders[i].id=i;
+		leaders[i].hue=1.0*(1+i)/(NumLeaders+1);
 	}
-	//engage target's descendants
-	struct insect_data *target=&insects[target_idx];
-	for (int i=0;i<target->nchildren;i++) {
-		int child_idx=target->children[i];
-		n+=engage_descendants(child_idx,insect_idx,leader_idx);
+	#pragma omp parallel for
+	for (int i=0;i<NumInsects;i++) {
+		int leader_idx=insects[i].leader_idx;
+		if (leader_idx>=0 && leader_idx!=i)
+			insects[i].leader_id=insects[leader_idx].leader_id;
 	}
-	return n;
 }
 
-void engage_enemies(int insect_idx) {
-	struct insect_data *parent,*leader,*insect;
-	
-	insect=&insects[insect_idx];
-	int leader_idx=insect->leader_idx;
-	if (leader_idx<0) return;
-	leader=&insects[leader_idx];
-
-	int node_idx=leader_idx;
-	int parent_idx=leader->parent;
-	int n=0;
-	while (parent_idx>=0) {
-		parent=&insects[parent_idx];
-		//all peers of node are enenmies, i.e. all children of parent except node
-		for (int i=0;i<parent->nchildren;i++) {
-			int child_idx=parent->children[i];
-			if (child_idx!=node_idx) {
-				n+=engage_descendants(child_idx,insect_idx,leader_idx);
-			}
-		}
-		//ascend to parent
-		node_idx=parent_idx;
-		parent_idx=parent->parent;
-	}
+void setup_model() {
+	setup_params();
+	setup_world();
 }
 
 void center_force(int insect_idx) {
 	struct insect_data *insect=&insects[insect_idx];
 	struct insect_action_data *action=&actions[insect_idx];
-	float dx,dy,dz,a;
+	compute_t dx,dy,dz,a;
 	dx=insect->x;
 	dy=insect->y;
 	dz=insect->z;
@@ -362,10 +492,11 @@ void center_force(int insect_idx) {
 	action->fx+=-dx*a;
 	action->fy+=-dy*a;
 	action->fz+=-dz*a;
+	action->ep+=0.5*a*(dx*dx+dy*dy+dz*dz);
 }
 
 void spring_force(int target, int peer, float r0, float D, struct insect_data*restrict insects, struct insect_action_data*restrict actions) {
-	float dx,dy,dz,r,a,b,c,fx,fy,fz;
+	compute_t dx,dy,dz,r,a,b,c,fx,fy,fz;
 	dx=insects[target].x-insects[peer].x;
 	dy=insects[target].y-insects[peer].y;
 	dz=insects[target].z-insects[peer].z;
@@ -377,6 +508,7 @@ void spring_force(int target, int peer, float r0, float D, struct insect_data*re
 	actions[target].fx+=fx;
 	actions[target].fy+=fy;
 	actions[target].fz+=fz;
+	actions[target].ep+=0.5*D*(r-r0)*(r-r0);
 	actions[peer].fx-=fx;
 	actions[peer].fy-=fy;
 	actions[peer].fz-=fz;
@@ -387,6 +519,34 @@ void tree_force(int a, int b) {
 	spring_force(a,b,params.grouping_radius,params.grouping_constant,insects,actions);
 }
 
+void spring_pull(int target, int peer, float r0, float D, int energy) {
+	//the spring force on target only, with its energy if target is the child
+	compute_t dx,dy,dz,r,a;
+	if (peer<0 || peer==target) return;
+	dx=insects[target].x-insects[peer].x;
+	dy=insects[target].y-insects[peer].y;
+	dz=insects[target].z-insects[peer].z;
+	r=sqrt(dx*dx+dy*dy+dz*dz);
+	a  = D*(r-r0)/r;
+	actions[target].fx-=dx*a;
+	actions[target].fy-=dy*a;
+	actions[target].fz-=dz*a;
+	if (energy)
+		actions[target].ep+=0.5*D*(r-r0)*(r-r0);
+}
+
+void tree_force_active() {
+	//block time steps: the springs to the parent and to the children, of the
+	//insects kicked on this step only
+	float r0=params.grouping_radius, D=params.grouping_constant;
+	for (int i=0;i<NumInsects;i++) {
+		if (!step_active(i)) continue;
+		spring_pull(i,insects[i].parent,r0,D,1);
+		for (int k=0;k<insects[i].nchildren;k++)
+			spring_pull(i,insects[i].children[k],r0,D,0);
+	}
+}
+
 void add_child(int p_idx, int c_idx) {
 	struct insect_data *p=&insects[p_idx];
 	int n=p->nchildren;
@@ -395,12 +555,15 @@ void add_child(int p_idx, int c_idx) {
 		exit(-1);
 	}
 	if (n<MAX_CHILDREN) {
+		int old_parent=insects[c_idx].parent;
 		p->nchildren++;
 		p->children[n]=c_idx;
 		insects[c_idx].parent=p_idx;
 		//update children of c to new leader
 		make_leader(c_idx,insects[p_idx].leader_idx,insects[p_idx].leader_id);	
+		journal_event(JOURNAL_ADD,c_idx,old_parent,p_idx);
 	} else {
+		COUNT(COUNTER_ADD_CHILD_OVERFLOWS,1);
 		add_child(p->children[0],c_idx);
 	}
 }
@@ -435,6 +598,7 @@ void remove_child(int p_idx, int c_idx) {
 			int promote_idx=c->children[0];
 			p->children[idx]=promote_idx;
 			insects[promote_idx].parent=p_idx;
+			journal_event(JOURNAL_MOVE,promote_idx,c_idx,p_idx);
 			//and attach remaining children of c to promote
 			for (int i=1;i<c->nchildren;i++) {
 				add_child(promote_idx,c->children[i]);
@@ -445,71 +609,436 @@ void remove_child(int p_idx, int c_idx) {
 				int leader_id=insects[c_idx].leader_id;
 				leaders[leader_id].insect_idx=promote_idx;
 				make_leader(promote_idx,promote_idx,leader_id);
+				journal_event(JOURNAL_PROMOTE,promote_idx,p_idx,p_idx);
 			}
 		}
 		//free insect from parents or leaders
 		insects[c_idx].parent=-1;
 		insects[c_idx].leader_id=-1;
 		insects[c_idx].leader_idx=-1;
+		journal_event(JOURNAL_REMOVE,c_idx,p_idx,-1);
 	} else {
 		printf("insect %d not a child of %d\n",c_idx,p_idx);
 		exit(-1);
 	}
 }
 
-void apply_velocities() {
+void clear_action(struct insect_action_data *a) {
+	a->fx=0;
+	a->fy=0;
+	a->fz=0;
+	a->rm=0;
+	a->ep=0;
+	a->new_parent=-1;
+}
+
+void clear_actions(struct insect_action_data *a) {
+	for (int i=0;i<NumInsects;i++)
+		clear_action(&a[i]);
+}
+
+//interaction terms of the force kernels
+#define FORCE_TREE    1
+#define FORCE_CENTER  2
+#define FORCE_ENEMIES 4
+#define FORCE_COULOMB 8
+
+int enabled_force_terms() {
+	int terms=0;
+	if (params.grouping_constant!=0) terms|=FORCE_TREE;
+	if (params.center_force_constant!=0) terms|=FORCE_CENTER;
+	if (params.attack_constant!=0 || params.defend_constant!=0 || params.fight_radius>0)
+		terms|=FORCE_ENEMIES;
+	if (params.coulomb_constant!=0) terms|=FORCE_COULOMB;
+	return terms;
+}
+
+//the fast force kernel, specialized below for each combination of terms
+//so that disabled terms are removed from the loops at compile time
+//the tree forces and the enemies accumulate into separate buffers and run
+//as concurrent tasks; actions were cleared and hold the centre force
+//already, see the fused pass
+static inline void fast_forces_kernel(const int terms) {
+	if (terms&FORCE_TREE) {
+		#pragma omp task
+		if (params.block_step_levels>0) {
+			tree_force_active();
+		} else {
+			for (int i=0;i<NumInsects;i++) {
+				int parent=insects[i].parent;
+				tree_force(i, parent);
+			}
+		}
+	}
+	if (terms&FORCE_ENEMIES) {
+		#pragma omp task
+		engage_all_enemies();
+	}
+}
+
+#define DEFINE_FAST_FORCES(terms) \
+	static void fast_forces_##terms() { fast_forces_kernel(terms); }
+DEFINE_FAST_FORCES(0)
+DEFINE_FAST_FORCES(1)
+DEFINE_FAST_FORCES(4)
+DEFINE_FAST_FORCES(5)
+
+static void (*const fast_forces_variants[8])()={
+	[0]=fast_forces_0, [FORCE_TREE]=fast_forces_1,
+	[FORCE_ENEMIES]=fast_forces_4, [FORCE_TREE|FORCE_ENEMIES]=fast_forces_5
+};
+
+
+void select_force_kernels() {
+	int terms=enabled_force_terms();
+	if (terms==force_terms) return;
+	force_terms=terms;
+	clear_actions(enemy_actions);
+	device_host_wrote(DEVICE_ENEMIES);
+	//the new terms act on all insects from this step on
+	memset(step_level,0,NumInsects);
+	//on the target, the tree forces are part of device_fast_forces()
+	fast_forces=fast_forces_variants[terms&(device_data_active?FORCE_ENEMIES:(FORCE_TREE|FORCE_ENEMIES))];
+	printf("force terms:%s%s%s%s\n",
+		(terms&FORCE_TREE)?" tree":"",
+		(terms&FORCE_CENTER)?" center":"",
+		(terms&FORCE_ENEMIES)?" enemies":"",
+		(terms&FORCE_COULOMB)?" coulomb":"");
+}
+
+void slow_forces() {
+	if (params.block_step_levels>0 && (force_terms&FORCE_COULOMB)) {
+		//only the insects kicked on this step, the others keep the forces
+		//and energies of their last kick
+		coulomb_repell_active(slow_actions);
+		return;
+	}
+	clear_actions(slow_actions);
+	if (device_data_active) {
+		//the forces stay on the target
+		if (force_terms&FORCE_COULOMB)
+			device_coulomb_repell(slow_actions);
+		else
+			device_host_wrote(DEVICE_FORCES);
+		return;
+	}
+	if (force_terms&FORCE_COULOMB) {
+		if (params.pm_grid>0) {
+			pm_coulomb_repell(slow_actions);
+		} else if (mpi_size>1) {
+			ranks_coulomb_repell(slow_actions);
+		} else if (params.coulomb_half_pairs) {
+			coulomb_repell_half_pairs(slow_actions);
+		} else {
+			#pragma omp taskloop
+			for (int i=0;i<NumInsects;i++)
+				coulomb_repell(i,slow_actions);
+		}
+	}
+}
+
+int calculate_forces(struct coulomb_batch *defer) {
+	//with defer, a half-pair coulomb evaluation is not done but described in
+	//*defer, for the caller to batch it with other models; returns whether
+	//it was deferred
+	respa_slow_step=(model_step%params.respa_interval==0);
+	int deferred=defer && respa_slow_step && (force_terms&FORCE_COULOMB)
+		&& params.pm_grid==0 && params.coulomb_half_pairs && params.block_step_levels==0;
+	if (deferred) {
+		clear_actions(slow_actions);
+		*defer=coulomb_batch_of_model(slow_actions);
+	}
+	int enemies=(force_terms&FORCE_ENEMIES)!=0;
+	if (device_data_active) {
+		//the copies the tasks below need, before they run concurrently:
+		//the fights read the positions and masses on the host
+		device_need_on_target(DEVICE_POSITIONS);
+		device_need_on_target(DEVICE_TREE);
+		if (enemies)
+			device_need_on_host(DEVICE_POSITIONS);
+	}
+	//the force terms are independent tasks, the group waits for all of them
+	#pragma omp taskgroup
+	{
+		//fast forces: every step
+		fast_forces();
+		if (device_data_active) {
+			#pragma omp task
+			device_fast_forces((force_terms&FORCE_TREE)!=0,(force_terms&FORCE_CENTER)!=0);
+		}
+		//slow forces: every respa_interval steps
+		if (respa_slow_step && !deferred) {
+			#pragma omp task
+			slow_forces();
+		}
+	}
+	if (device_data_active && enemies)
+		device_host_wrote(DEVICE_ENEMIES);
+	return deferred;
+}
+
+//the leap-frog step of a block of insects, in the fused pass
+//kick: the velocities and masses from the forces at the current positions
+static int next_step_level(int i, compute_t fx, compute_t fy, compute_t fz) {
+	//the largest step resolving the insect's acceleration and motion on the
+	//scale of the coulomb radius, eta*min(sqrt(r0/|a|),r0/|v|); the step
+	//grows by one level at a time, and only onto an aligned block
+	struct insect_data *p=&insects[i];
+	float r0=params.coulomb_radius;
+	float a=sqrtf(fx*fx+fy*fy+fz*fz)/p->m;
+	float v=sqrtf(p->vx*p->vx+p->vy*p->vy+p->vz*p->vz);
+	float dti=params.block_step_eta*MIN(sqrtf(r0/a),r0/v);
+	int l=0;
+	while (l<params.block_step_levels && params.dt*(2<<l)<=dti)
+		l++;
+	int current=step_level[i];
+	if (l>current) {
+		l=current+1;
+		if (model_step&((1<<l)-1))
+			l=current;
+	}
+	return l;
+}
+
+static void kick_block(int i0, int i1, float ws) {
 	float dt=params.dt;
-	for (int i=0;i<NumInsects;i++) {
+	float beta=params.damping_constant;
+	int block=params.block_step_levels>0;
+	int kicks=0;
+	for (int i=i0;i<i1;i++) {
+		float h=dt;
+		if (block) {
+			if (!step_active(i)) {
+				//no forces were evaluated, but its fights moved mass
+				insects[i].m=MAX(insects[i].m+dt*enemy_actions[i].rm,params.mass_min);
+				if (sync_pending[i]) {
+					step_level[i]=0;
+					sync_pending[i]=0;
+				}
+				continue;
+			}
+			h=dt*(model_step-last_kick[i]);
+		}
+		compute_t fx=actions[i].fx+enemy_actions[i].fx+ws*slow_actions[i].fx;
+		compute_t fy=actions[i].fy+enemy_actions[i].fy+ws*slow_actions[i].fy;
+		compute_t fz=actions[i].fz+enemy_actions[i].fz+ws*slow_actions[i].fz;
+		insects[i].vx+=h*(fx/insects[i].m-insects[i].vx*beta);
+		insects[i].vy+=h*(fy/insects[i].m-insects[i].vy*beta);
+		insects[i].vz+=h*(fz/insects[i].m-insects[i].vz*beta);
+		//the mass transfers are those of this step's fights only
+		insects[i].m +=dt*(enemy_actions[i].rm);
+		insects[i].m  =MAX(insects[i].m,params.mass_min);
+		if (block) {
+			last_kick[i]=model_step;
+			step_level[i]=next_step_level(i,fx,fy,fz);
+		}
+		kicks++;
+	}
+	COUNT(COUNTER_KICKS,kicks);
+}
+
+//drift: the positions of the next step, whose fast forces start with the
+//centre force of the insects kicked on it
+static void drift_block(int i0, int i1, int center, int next_step) {
+	float dt=params.dt;
+	for (int i=i0;i<i1;i++) {
 		insects[i].x+=insects[i].vx*dt;
 		insects[i].y+=insects[i].vy*dt;
 		insects[i].z+=insects[i].vz*dt;
+		clear_action(&actions[i]);
+		if (center && step_active_at(i,next_step))
+			center_force(i);
 	}
 }
 
-void apply_forces() {
-	float dt=params.dt;
-	float beta=params.damping_constant;
+void drift() {
+	if (device_data_active) {
+		device_drift();
+		return;
+	}
+	int center=(force_terms&FORCE_CENTER)!=0;
+	#pragma omp taskloop
+	for (int i0=0;i0<NumInsects;i0+=ANALYSIS_BLOCK)
+		drift_block(i0,MIN(NumInsects,i0+ANALYSIS_BLOCK),center,model_step);
+}
+
+float slow_force_weight() {
+	//impulse of the slow forces, only on steps where they were evaluated
+	return respa_slow_step?params.respa_interval:0;
+}
+
+void step_sync(int i) {
+	//a synchronization point for a topology change: the insect goes back to
+	//the base step, from the next step on if its forces were not evaluated
+	//on this one
+	if (i<0) return;
+	if (step_active(i))
+		step_level[i]=0;
+	else
+		sync_pending[i]=1;
+}
+
+void apply_forces(struct frame *snapshot) {
+	//desertions change the tree, in index order
+	int desertions=0;
 	for (int i=0;i<NumInsects;i++) {
-		insects[i].vx+=dt*(actions[i].fx/insects[i].m-insects[i].vx*beta);
-		insects[i].vy+=dt*(actions[i].fy/insects[i].m-insects[i].vy*beta);
-		insects[i].vz+=dt*(actions[i].fz/insects[i].m-insects[i].vz*beta);
-		insects[i].m +=dt*(actions[i].rm);
-		insects[i].m  =MAX(insects[i].m,params.mass_min);
-		int npar=actions[i].new_parent;
+		int npar=enemy_actions[i].new_parent;
 		if (npar>=0) {
 			int par=insects[i].parent;
 			remove_child(par,i);
 			add_child(npar,i);
+			desertions++;
+			if (params.block_step_levels>0) {
+				step_sync(i);
+				step_sync(par);
+				step_sync(npar);
+			}
 		}
 	}
-}
-
-void calculate_forces() {
-	for (int i=0;i<NumInsects;i++) {
-		actions[i].fx=0;
-		actions[i].fy=0;
-		actions[i].fz=0;
-		actions[i].rm=0;
-		actions[i].new_parent=-1;
+	COUNT(COUNTER_DESERTIONS,desertions);
+	if (desertions)
+		device_host_wrote(DEVICE_TREE);
+	float ws=slow_force_weight();
+	int center=(force_terms&FORCE_CENTER)!=0;
+	int device=device_data_active;
+	if (device)
+		device_kick(ws);
+	int analyze=analysis_begin(model_step);
+	if (snapshot) {
+		device_need_on_host(DEVICE_POSITIONS);
+		frame_capture_begin(snapshot,model_step);
 	}
-	for (int i=0;i<NumInsects;i++) {
-		int parent=insects[i].parent;
-		tree_force(i, parent);
-	}
-	for (int i=0;i<NumInsects;i++) {
-		center_force(i);
-		coulomb_repell(i);
-		engage_enemies(i);
+	//one pass over the blocks: the analyses and the snapshot see this step's
+	//state between the kick and the drift to the next step; on the target,
+	//the kick, the drift and the analyses that run there are passes of
+	//their own, see devicedata.h
+	if (analyze && device)
+		analysis_visit_device(model_step);
+	if (!device || analyze || snapshot) {
+		#pragma omp taskloop
+		for (int b=0;b<(NumInsects+ANALYSIS_BLOCK-1)/ANALYSIS_BLOCK;b++) {
+			int i0=b*ANALYSIS_BLOCK;
+			int i1=MIN(NumInsects,i0+ANALYSIS_BLOCK);
+			if (!device)
+				kick_block(i0,i1,ws);
+			if (analyze)
+				analysis_visit_block(model_step,b);
+			if (snapshot)
+				frame_capture_block(snapshot,i0,i1);
+			if (!device)
+				drift_block(i0,i1,center,model_step+1);
+		}
 	}
+	if (analyze)
+		analysis_end(model_step);
+	if (device)
+		device_drift();
+}
+
+//an iteration in two halves, so that the slow forces of several models can
+//be evaluated together in between, see ensemble.c
+int iteration_forces(struct coulomb_batch *defer)
+{
+	//pick the force kernels matching the currently enabled interactions
+	select_force_kernels();
+	//leap-frog method, the drift of a step is fused into the previous step
+	if (model_step==0)
+		drift();
+	return calculate_forces(defer);
+}
+
+void iteration_finish(struct frame *snapshot)
+{
+	apply_forces(snapshot);
+	model_step++;
 }
 
-void iteration()
+void iteration(struct frame *snapshot)
 {
+	//runs as part of the task graph built in main(), loops are taskloops
 	int s=section_start("model");
-	//leap-frog method
-	apply_velocities();
-	calculate_forces();
-	apply_forces();
+	iteration_forces(NULL);
+	iteration_finish(snapshot);
 	section_end(s);
 }
 
+void model_save(struct model_state *m) {
+	m->params=params;
+	m->num_insects=NumInsects;
+	m->num_leaders=NumLeaders;
+	m->leaders=leaders;
+	m->insects=insects;
+	m->actions=actions;
+	m->slow_actions=slow_actions;
+	m->enemy_actions=enemy_actions;
+	m->model_step=model_step;
+	m->respa_slow_step=respa_slow_step;
+	m->force_terms=force_terms;
+	m->step_level=step_level;
+	m->last_kick=last_kick;
+	m->sync_pending=sync_pending;
+	m->fast_forces=fast_forces;
+	m->coulomb_pos=coulomb_pos;
+	m->coulomb_acc=coulomb_acc;
+	m->coulomb_order=coulomb_order;
+}
+
+void model_load(const struct model_state *m) {
+	params=m->params;
+	NumInsects=m->num_insects;
+	NumLeaders=m->num_leaders;
+	leaders=m->leaders;
+	insects=m->insects;
+	actions=m->actions;
+	slow_actions=m->slow_actions;
+	enemy_actions=m->enemy_actions;
+	model_step=m->model_step;
+	respa_slow_step=m->respa_slow_step;
+	force_terms=m->force_terms;
+	step_level=m->step_level;
+	last_kick=m->last_kick;
+	sync_pending=m->sync_pending;
+	fast_forces=m->fast_forces;
+	coulomb_pos=m->coulomb_pos;
+	coulomb_acc=m->coulomb_acc;
+	coulomb_order=m->coulomb_order;
+}
+
+//parameters that can be set by name
+#define PARAMETER(name,type) {#name,offsetof(struct model_parameters,name),type}
+struct parameter_info {
+	const char *name;
+	size_t offset;
+	char type;                   // 'f' for float, 'i' for int
+} parameter_table[]={
+	PARAMETER(x0,'f'), PARAMETER(y0,'f'), PARAMETER(z0,'f'), PARAMETER(r0,'f'),
+	PARAMETER(lx,'f'), PARAMETER(ly,'f'), PARAMETER(lz,'f'),
+	PARAMETER(dt,'f'),
+	PARAMETER(grouping_radius,'f'), PARAMETER(grouping_constant,'f'),
+	PARAMETER(coulomb_constant,'f'), PARAMETER(coulomb_radius,'f'),
+	PARAMETER(coulomb_half_pairs,'i'), PARAMETER(pm_grid,'i'),
+	PARAMETER(damping_constant,'f'),
+	PARAMETER(attack_radius,'f'), PARAMETER(attack_constant,'f'), PARAMETER(defend_constant,'f'),
+	PARAMETER(fight_radius,'f'), PARAMETER(fight_mass_rate,'f'), PARAMETER(surrender_mass_ratio,'f'),
+	PARAMETER(center_force_constant,'f'),
+	PARAMETER(respa_interval,'i'), PARAMETER(block_step_levels,'i'), PARAMETER(block_step_eta,'f'),
+	PARAMETER(mass_min,'f'),
+	PARAMETER(num_insects,'f'), PARAMETER(max_tree_depth,'i'), PARAMETER(seed,'i'),
+	PARAMETER(rivalism_iteration,'i'),
+	PARAMETER(journal,'i'),
+	PARAMETER(render_every,'i'), PARAMETER(render_scale,'f'), PARAMETER(render_budget,'f'),
+};
+
+int set_parameter(struct model_parameters *p, const char *name, const char *value) {
+	//returns 0 if there is no parameter of that name
+	for (size_t k=0;k<sizeof(parameter_table)/sizeof(parameter_table[0]);k++) {
+		struct parameter_info *info=&parameter_table[k];
+		if (strcmp(info->name,name)!=0) continue;
+		if (info->type=='f')
+			*(float*)((char*)p+info->offset)=atof(value);
+		else
+			*(int*)((char*)p+info->offset)=atol(value);
+		return 1;
+	}
+	return 0;
+}
@@ -3,6 +3,10 @@
 
 #include <stdio.h>
 
+#include "precision.h"
+
+
+#define MAX_BLOCK_STEP_LEVELS 7
 #define MAX_CHILDREN 8
 #define MAX_NUM_LEADERS 1024
 
@@ -16,6 +20,8 @@ struct model_parameters {
 	
 	float coulomb_constant;
 	float coulomb_radius;
+	int coulomb_half_pairs;      // evaluate each coulomb pair once and apply the reaction
+	int pm_grid;                 // particle-mesh cells per dimension (power of two), 0 for direct summation
 
 	float damping_constant;
 
@@ -29,14 +35,28 @@ struct model_parameters {
 
 	float center_force_constant;
 
+	int respa_interval;          // evaluate the coulomb repulsion every respa_interval steps
+	int block_step_levels;       // per-insect steps of up to dt*2^block_step_levels, 0 for a global dt, see README.md
+	float block_step_eta;        // accuracy of the per-insect steps
+
 	float mass_min;
 
 	float num_insects;
 	int max_tree_depth;
+	int seed;
 
 	int num_iterations;
+	int rivalism_iteration;      // iteration at which rivalism is enabled
 
 	char* output_dir;
+	int journal;                 // write the changes of the tree to journal.bin
+	int render;                  // render the frames in process
+	int render_every;            // render every render_every iterations
+	float render_scale;          // image resolution relative to 1920x1080
+	float render_budget;         // adapt the cadence and resolution to this fraction of the iteration time, 0 for fixed
+	char* frame_shm;             // name of the shared memory frame ring for an external viewer, NULL for none
+	int device;                  // keep the arrays on an offload target and evaluate the coulomb repulsion there
+	int validate;                // compare with the reference implementation every validate iterations, 0 for never
 };
 
 extern struct model_parameters params;
@@ -51,7 +71,9 @@ extern struct leader_data *leaders;
 extern int NumLeaders;
 
 struct insect_data {
-	float x,y,z,vx,vy,vz,m;      // 3D coordinates and velocities and mass
+	storage_t x,y,z;             // 3D coordinates
+	velocity_t vx,vy,vz;         // velocities
+	storage_t m;                 // mass
 	int parent;                  // index to the parent insect
 	int nchildren;               // number of children
 	int children[MAX_CHILDREN];  // indices of the children
@@ -60,7 +82,7 @@ struct insect_data {
 };
 
 struct insect_data_double {
-	float x,y,z,vx,vy,vz,m;
+	double x,y,z,vx,vy,vz,m;
 	int parent;
 	int nchildren;
 	int children[MAX_CHILDREN];
@@ -73,15 +95,75 @@ extern int NumInsects;
 extern struct insect_data *insects;
 
 struct insect_action_data {
-	float fx,fy,fz,rm;           // 3D forces, and mass rate
+	compute_t fx,fy,fz,rm;       // 3D forces, and mass rate
+	compute_t ep;                // potential energy
 	int new_parent;              // index of new parent in next iteration
 };
 
 extern struct insect_action_data *actions;
+extern struct insect_action_data *slow_actions;
+extern struct insect_action_data *enemy_actions;
+
+extern int model_step;
+
+// block time steps: insect i is kicked on the steps that are multiples of
+// 2^step_level[i], and only then are its forces evaluated
+extern unsigned char *step_level;
+
+static inline int step_active_at(int i, int step) {
+	return (step&((1<<step_level[i])-1))==0;
+}
+
+static inline int step_active(int i) {
+	return step_active_at(i,model_step);
+}
+
+// everything the model keeps between iterations, to switch between models
+struct model_state {
+	struct model_parameters params;
+	int num_insects, num_leaders;
+	struct leader_data *leaders;
+	struct insect_data *insects;
+	struct insect_action_data *actions, *slow_actions, *enemy_actions;
+	int model_step, respa_slow_step, force_terms;
+	unsigned char *step_level, *sync_pending;
+	int *last_kick;
+	void (*fast_forces)();
+	compute_t *coulomb_pos, *coulomb_acc;
+	int *coulomb_order;
+};
+
+// a half-pair coulomb evaluation, see coulomb_half_pairs_batch()
+struct coulomb_batch {
+	int n;
+	const struct insect_data *insects;
+	struct insect_action_data *out;
+	compute_t *pos, *acc;        // the model's buffers
+	compute_t D, r0;
+	long long p0, p1;            // the range of tile pairs, all by default
+};
 
 void setup_model();
-void iteration();
+void setup_params();
+void setup_world();
+struct frame;
+void iteration(struct frame *snapshot);
+int iteration_forces(struct coulomb_batch *defer);
+void iteration_finish(struct frame *snapshot);
+struct coulomb_batch coulomb_batch_of_model(struct insect_action_data *out);
+void coulomb_half_pairs_batch(struct coulomb_batch *batch, int nb);
+void model_save(struct model_state *m);
+void model_load(const struct model_state *m);
+int set_parameter(struct model_parameters *p, const char *name, const char *value);
 int count_children(int idx);
 void model_enable_rivalism();
+void clear_action(struct insect_action_data *a);
+void clear_actions(struct insect_action_data *a);
+float slow_force_weight();
+void center_force(int insect_idx);
+void tree_force(int a, int b);
+void coulomb_repell(int i, struct insect_action_data *out);
+void add_child(int p_idx, int c_idx);
+void remove_child(int p_idx, int c_idx);
 
 #endif
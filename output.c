@@ -0,0 +1,466 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <aio.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "support.h"
+#include "output.h"
+
+enum output_backend {OUTPUT_SYNC, OUTPUT_AIO, OUTPUT_URING};
+const char *output_backend_names[]={"sync","aio","uring"};
+
+struct output_file {
+	int fd;
+	off_t offset;                // of the next write
+	char *chunk;                 // buffered data, not submitted yet
+	size_t fill, size;           // size grows with the file to OUTPUT_CHUNK
+	int pending;                 // writes in flight, output thread only
+	int closing;
+};
+
+// a write or close queued by the tasks for the output thread
+struct output_job {
+	struct output_file *file;
+	char *buf;                   // NULL to close the file
+	size_t len;
+	off_t offset;
+	struct output_job *next;
+};
+
+// a write in flight, the backends identify it by its slot
+struct output_request {
+	struct output_file *file;
+	char *buf;
+	size_t len;
+	off_t offset;
+	double submitted;
+	struct aiocb cb;
+};
+
+enum output_backend output_backend=OUTPUT_SYNC;
+int output_initialized=0;
+pthread_t output_thread;
+pthread_mutex_t output_lock=PTHREAD_MUTEX_INITIALIZER;   // the files' chunks and the queue
+pthread_cond_t output_queue_cond=PTHREAD_COND_INITIALIZER;
+struct output_job *output_queue_head, *output_queue_tail;
+int output_stopping;
+// the slots of the writes in flight belong to the output thread
+int output_max_inflight;
+struct output_request *output_requests;
+int *output_free_slots, output_num_free;
+
+struct output_stats {
+	long long writes, bytes, stalls;
+	double latency_total, latency_max, stall_time;
+} output_stats;
+
+// io_uring without liburing: the rings are mapped and driven by hand
+struct uring {
+	int fd;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+} uring;
+
+int uring_setup(unsigned entries) {
+	struct io_uring_params p;
+	memset(&p,0,sizeof(p));
+	int fd=syscall(__NR_io_uring_setup,entries,&p);
+	if (fd<0) return -1;
+	size_t sq_size=p.sq_off.array+p.sq_entries*sizeof(unsigned);
+	size_t cq_size=p.cq_off.cqes+p.cq_entries*sizeof(struct io_uring_cqe);
+	if (p.features&IORING_FEAT_SINGLE_MMAP)
+		sq_size=cq_size=MAX(sq_size,cq_size);
+	char *sq=mmap(NULL,sq_size,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,fd,IORING_OFF_SQ_RING);
+	if (sq==MAP_FAILED) {
+		close(fd);
+		return -1;
+	}
+	char *cq=sq;
+	if (!(p.features&IORING_FEAT_SINGLE_MMAP)) {
+		cq=mmap(NULL,cq_size,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,fd,IORING_OFF_CQ_RING);
+		if (cq==MAP_FAILED) {
+			close(fd);
+			return -1;
+		}
+	}
+	uring.sqes=mmap(NULL,p.sq_entries*sizeof(struct io_uring_sqe),PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,fd,IORING_OFF_SQES);
+	if (uring.sqes==MAP_FAILED) {
+		close(fd);
+		return -1;
+	}
+	uring.fd=fd;
+	uring.sq_head=(unsigned*)(sq+p.sq_off.head);
+	uring.sq_tail=(unsigned*)(sq+p.sq_off.tail);
+	uring.sq_mask=(unsigned*)(sq+p.sq_off.ring_mask);
+	uring.sq_array=(unsigned*)(sq+p.sq_off.array);
+	uring.cq_head=(unsigned*)(cq+p.cq_off.head);
+	uring.cq_tail=(unsigned*)(cq+p.cq_off.tail);
+	uring.cq_mask=(unsigned*)(cq+p.cq_off.ring_mask);
+	uring.cqes=(struct io_uring_cqe*)(cq+p.cq_off.cqes);
+	//the ring predates IORING_OP_WRITE on some kernels, whose writes would
+	//all fail on completion
+	size_t probe_size=sizeof(struct io_uring_probe)+256*sizeof(struct io_uring_probe_op);
+	struct io_uring_probe *probe=calloc(1,probe_size);
+	int supported=syscall(__NR_io_uring_register,fd,IORING_REGISTER_PROBE,probe,256)>=0
+		&& probe->last_op>=IORING_OP_WRITE
+		&& (probe->ops[IORING_OP_WRITE].flags&IO_URING_OP_SUPPORTED);
+	free(probe);
+	if (!supported) {
+		close(fd);
+		errno=EOPNOTSUPP;
+		return -1;
+	}
+	return 0;
+}
+
+void uring_submit(int slot) {
+	//the only producer is the output thread
+	struct output_request *r=&output_requests[slot];
+	unsigned tail=*uring.sq_tail;
+	unsigned idx=tail&*uring.sq_mask;
+	struct io_uring_sqe *sqe=&uring.sqes[idx];
+	memset(sqe,0,sizeof(*sqe));
+	sqe->opcode=IORING_OP_WRITE;
+	sqe->fd=r->file->fd;
+	sqe->addr=(unsigned long)r->buf;
+	sqe->len=r->len;
+	sqe->off=r->offset;
+	sqe->user_data=slot;
+	uring.sq_array[idx]=idx;
+	__atomic_store_n(uring.sq_tail,tail+1,__ATOMIC_RELEASE);
+	if (syscall(__NR_io_uring_enter,uring.fd,1,0,0,NULL,0)<0) {
+		printf("io_uring_enter failed: %s\n",strerror(errno));
+		exit(-1);
+	}
+}
+
+void output_complete(int slot, long result);
+
+void uring_reap(int wait) {
+	if (wait && syscall(__NR_io_uring_enter,uring.fd,0,1,IORING_ENTER_GETEVENTS,NULL,0)<0 && errno!=EINTR) {
+		printf("io_uring_enter failed: %s\n",strerror(errno));
+		exit(-1);
+	}
+	unsigned head=*uring.cq_head;
+	while (head!=__atomic_load_n(uring.cq_tail,__ATOMIC_ACQUIRE)) {
+		struct io_uring_cqe *cqe=&uring.cqes[head&*uring.cq_mask];
+		int slot=cqe->user_data;
+		long res=cqe->res;
+		head++;
+		__atomic_store_n(uring.cq_head,head,__ATOMIC_RELEASE);
+		output_complete(slot,res);
+		head=*uring.cq_head;
+	}
+}
+
+void aio_submit(int slot) {
+	struct output_request *r=&output_requests[slot];
+	memset(&r->cb,0,sizeof(r->cb));
+	r->cb.aio_fildes=r->file->fd;
+	r->cb.aio_buf=r->buf;
+	r->cb.aio_nbytes=r->len;
+	r->cb.aio_offset=r->offset;
+	if (aio_write(&r->cb)!=0) {
+		printf("aio_write failed: %s\n",strerror(errno));
+		exit(-1);
+	}
+}
+
+void aio_reap(int wait) {
+	const struct aiocb *list[output_max_inflight];
+	int n=0;
+	for (int slot=0;slot<output_max_inflight;slot++)
+		if (output_requests[slot].file)
+			list[n++]=&output_requests[slot].cb;
+	if (wait && n>0)
+		aio_suspend(list,n,NULL);
+	for (int slot=0;slot<output_max_inflight;slot++) {
+		struct output_request *r=&output_requests[slot];
+		if (r->file && aio_error(&r->cb)!=EINPROGRESS)
+			output_complete(slot,aio_return(&r->cb));
+	}
+}
+
+void output_reap(int wait) {
+	if (output_backend==OUTPUT_URING)
+		uring_reap(wait);
+	else if (output_backend==OUTPUT_AIO)
+		aio_reap(wait);
+}
+
+void output_close_fd(struct output_file *f);
+void output_submit(struct output_file *f, char *buf, size_t len, off_t offset);
+
+void output_close_fd(struct output_file *f) {
+	close(f->fd);
+	mem_free(f->chunk);
+	mem_free(f);
+}
+
+void output_submit(struct output_file *f, char *buf, size_t len, off_t offset) {
+	//takes over buf, called by the output thread
+	if (output_backend==OUTPUT_SYNC) {
+		double t=now();
+		size_t done=0;
+		while (done<len) {
+			ssize_t n=pwrite(f->fd,buf+done,len-done,offset+done);
+			if (n<=0) {
+				printf("write failed: %s\n",n<0 ? strerror(errno) : "no progress");
+				exit(-1);
+			}
+			done+=n;
+		}
+		mem_free(buf);
+		double latency=now()-t;
+		output_stats.writes++;
+		output_stats.bytes+=len;
+		output_stats.latency_total+=latency;
+		output_stats.latency_max=MAX(output_stats.latency_max,latency);
+		return;
+	}
+	if (output_num_free==0) {
+		//the bound on writes in flight, the output thread waits
+		double t=now();
+		while (output_num_free==0)
+			output_reap(1);
+		output_stats.stalls++;
+		output_stats.stall_time+=now()-t;
+	}
+	int slot=output_free_slots[--output_num_free];
+	struct output_request *r=&output_requests[slot];
+	r->file=f;
+	r->buf=buf;
+	r->len=len;
+	r->offset=offset;
+	r->submitted=now();
+	f->pending++;
+	if (output_backend==OUTPUT_URING)
+		uring_submit(slot);
+	else
+		aio_submit(slot);
+}
+
+void output_complete(int slot, long result) {
+	struct output_request *r=&output_requests[slot];
+	struct output_file *f=r->file;
+	if (result<0) {
+		printf("write failed: %s\n",strerror(-result));
+		exit(-1);
+	}
+	if (result==0 && r->len>0) {
+		//resubmitting would not make progress either
+		printf("write failed: no progress at offset %lld\n",(long long)r->offset);
+		exit(-1);
+	}
+	double latency=now()-r->submitted;
+	output_stats.writes++;
+	output_stats.bytes+=result;
+	output_stats.latency_total+=latency;
+	output_stats.latency_max=MAX(output_stats.latency_max,latency);
+	char *buf=r->buf;
+	size_t len=r->len;
+	off_t offset=r->offset;
+	r->file=NULL;
+	output_free_slots[output_num_free++]=slot;
+	f->pending--;
+	if ((size_t)result<len) {
+		//a short write, the rest goes out as a new one
+		char *rest=mem_malloc(MEM_OUTPUT,len-result);
+		memcpy(rest,buf+result,len-result);
+		output_submit(f,rest,len-result,offset+result);
+	}
+	mem_free(buf);
+	if (f->closing && f->pending==0)
+		output_close_fd(f);
+}
+
+void output_run(struct output_job *job) {
+	struct output_file *f=job->file;
+	if (job->buf) {
+		output_submit(f,job->buf,job->len,job->offset);
+	} else {
+		f->closing=1;
+		if (f->pending==0)
+			output_close_fd(f);
+	}
+	mem_free(job);
+}
+
+void *output_thread_main(void *arg) {
+	//submits the queued jobs in order and reaps their completions, the only
+	//place that waits for the filesystem
+	for (;;) {
+		pthread_mutex_lock(&output_lock);
+		while (output_queue_head==NULL && !output_stopping && output_num_free==output_max_inflight)
+			pthread_cond_wait(&output_queue_cond,&output_lock);
+		struct output_job *job=output_queue_head;
+		if (job) {
+			output_queue_head=job->next;
+			if (output_queue_head==NULL) output_queue_tail=NULL;
+		}
+		int stopping=output_stopping;
+		pthread_mutex_unlock(&output_lock);
+		if (job) {
+			output_run(job);
+			output_reap(0);
+		} else if (output_num_free<output_max_inflight) {
+			//new jobs queue up meanwhile
+			output_reap(1);
+		} else if (stopping) {
+			break;
+		}
+	}
+	return NULL;
+}
+
+void output_enqueue(struct output_file *f, char *buf, size_t len, off_t offset) {
+	//with output_lock held
+	struct output_job *job=mem_malloc(MEM_OUTPUT,sizeof(struct output_job));
+	job->file=f;
+	job->buf=buf;
+	job->len=len;
+	job->offset=offset;
+	job->next=NULL;
+	if (!output_initialized) {
+		//before setup_output() the writes are blocking
+		output_run(job);
+		return;
+	}
+	if (output_queue_tail)
+		output_queue_tail->next=job;
+	else
+		output_queue_head=job;
+	output_queue_tail=job;
+	pthread_cond_signal(&output_queue_cond);
+}
+
+void setup_output() {
+	const char *name=getenv("OUTPUT_BACKEND");
+	output_max_inflight=MAX(1,getenvl("OUTPUT_INFLIGHT",32));
+	output_backend=OUTPUT_URING;
+	if (name && strcmp(name,"aio")==0)
+		output_backend=OUTPUT_AIO;
+	else if (name && strcmp(name,"sync")==0)
+		output_backend=OUTPUT_SYNC;
+	else if (name && *name && strcmp(name,"uring")!=0) {
+		printf("unknown OUTPUT_BACKEND %s\n",name);
+		exit(-1);
+	}
+	if (output_backend==OUTPUT_URING && uring_setup(output_max_inflight)!=0) {
+		printf("io_uring not available (%s), using aio\n",strerror(errno));
+		output_backend=OUTPUT_AIO;
+	}
+	output_requests=mem_calloc(MEM_OUTPUT,output_max_inflight,sizeof(struct output_request));
+	output_free_slots=mem_malloc(MEM_OUTPUT,output_max_inflight*sizeof(int));
+	output_num_free=output_max_inflight;
+	for (int k=0;k<output_max_inflight;k++)
+		output_free_slots[k]=output_max_inflight-1-k;
+	memset(&output_stats,0,sizeof(output_stats));
+	output_stopping=0;
+	if (pthread_create(&output_thread,NULL,output_thread_main,NULL)!=0) {
+		printf("cannot start the output thread\n");
+		exit(-1);
+	}
+	output_initialized=1;
+	printf("output backend: %s, %d writes in flight\n",output_backend_names[output_backend],output_max_inflight);
+}
+
+void done_output() {
+	if (!output_initialized) return;
+	//the output thread finishes the queue and the writes in flight
+	pthread_mutex_lock(&output_lock);
+	output_stopping=1;
+	pthread_cond_signal(&output_queue_cond);
+	pthread_mutex_unlock(&output_lock);
+	pthread_join(output_thread,NULL);
+	//anything written later is written right away
+	output_initialized=0;
+	output_backend=OUTPUT_SYNC;
+	struct output_stats *s=&output_stats;
+	printf("output: %lld writes, %.1f MB, latency mean %.3f ms max %.3f ms, %lld stalls for %.3f s\n",
+		s->writes,s->bytes/1e6,s->writes?1e3*s->latency_total/s->writes:0,1e3*s->latency_max,s->stalls,s->stall_time);
+}
+
+struct output_file *output_open(const char *filename) {
+	int fd=open(filename,O_WRONLY|O_CREAT|O_TRUNC,0644);
+	if (fd<0) return NULL;
+	struct output_file *f=mem_calloc(MEM_OUTPUT,1,sizeof(struct output_file));
+	f->fd=fd;
+	return f;
+}
+
+void output_flush_locked(struct output_file *f) {
+	if (f->fill==0) return;
+	char *buf=mem_malloc(MEM_OUTPUT,f->fill);
+	memcpy(buf,f->chunk,f->fill);
+	output_enqueue(f,buf,f->fill,f->offset);
+	f->offset+=f->fill;
+	f->fill=0;
+}
+
+void output_write(struct output_file *f, const void *data, size_t len) {
+	//buffers data, and submits the buffer when full
+	const char *p=data;
+	pthread_mutex_lock(&output_lock);
+	while (len>0) {
+		size_t n=MIN(len,OUTPUT_CHUNK-f->fill);
+		if (f->fill+n>f->size) {
+			//small files keep small buffers
+			size_t size=MAX(f->size,OUTPUT_CHUNK_MIN);
+			while (size<f->fill+n) size*=2;
+			f->size=MIN(size,OUTPUT_CHUNK);
+			f->chunk=mem_realloc(MEM_OUTPUT,f->chunk,f->size);
+		}
+		memcpy(f->chunk+f->fill,p,n);
+		f->fill+=n;
+		p+=n;
+		len-=n;
+		if (f->fill==OUTPUT_CHUNK)
+			output_flush_locked(f);
+	}
+	pthread_mutex_unlock(&output_lock);
+}
+
+void output_flush(struct output_file *f) {
+	pthread_mutex_lock(&output_lock);
+	output_flush_locked(f);
+	pthread_mutex_unlock(&output_lock);
+}
+
+void output_close(struct output_file *f) {
+	//the file is closed once its last write completed
+	pthread_mutex_lock(&output_lock);
+	output_flush_locked(f);
+	output_enqueue(f,NULL,0,0);
+	pthread_mutex_unlock(&output_lock);
+}
+
+// stdio streams on top, the stream's buffer is flushed by fflush or when full
+ssize_t output_cookie_write(void *cookie, const char *buf, size_t size) {
+	output_write(cookie,buf,size);
+	output_flush(cookie);
+	return size;
+}
+
+int output_cookie_close(void *cookie) {
+	output_close(cookie);
+	return 0;
+}
+
+FILE *output_fopen(const char *filename) {
+	struct output_file *f=output_open(filename);
+	if (f==NULL) return NULL;
+	cookie_io_functions_t io={NULL,output_cookie_write,NULL,output_cookie_close};
+	FILE *fp=fopencookie(f,"w",io);
+	setvbuf(fp,NULL,_IOFBF,1<<16);
+	return fp;
+}
@@ -0,0 +1,31 @@
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+#include <stdio.h>
+#include <stddef.h>
+
+// asynchronous output files
+// writes are buffered per file and submitted as large writes at explicit
+// offsets, so they complete in any order. OUTPUT_BACKEND selects io_uring
+// (uring, the default), POSIX AIO (aio) or blocking writes (sync); uring
+// falls back to aio where the kernel refuses it or has no ring writes. At
+// most OUTPUT_INFLIGHT writes are in flight. The tasks only copy into the
+// file's buffer and queue full buffers; a dedicated output thread submits
+// them and reaps their completions, and is the only one to wait when the
+// bound is reached, so a stalled filesystem grows the queue but never blocks
+// an OpenMP worker.
+
+#define OUTPUT_CHUNK (1<<20)         // bytes buffered per file before a write
+#define OUTPUT_CHUNK_MIN (1<<12)     // the first buffer, doubled as the file grows
+
+struct output_file;
+
+void setup_output();
+void done_output();
+struct output_file *output_open(const char *filename);
+void output_write(struct output_file *f, const void *data, size_t len);
+void output_flush(struct output_file *f);
+void output_close(struct output_file *f);
+FILE *output_fopen(const char *filename);
+
+#endif
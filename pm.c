@@ -0,0 +1,296 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "model.h"
+#include "support.h"
+#include "pm.h"
+
+#define M_PI 3.14159265358979323846
+
+//split radius in cells, the mesh part is accurate to about 1% at 4 cells
+#define PM_SPLIT_CELLS 4
+
+compute_t pm_split_radius;
+
+int pm_n;            // mesh cells per dimension
+int pm_np;           // padded mesh size per dimension, 2*pm_n
+double pm_h[3];      // cell sizes
+double pm_lo[3];     // lower corner of the box
+double *pm_green;    // transformed long-range kernel, complex interleaved
+double *pm_rho;      // charge density and potential, complex interleaved
+double *pm_phi;      // potential on the unpadded mesh
+
+//short-range cell list
+int *pm_cell_start;
+int *pm_cell_insects;
+int pm_ncells[3];
+compute_t pm_cell_lo[3];
+compute_t pm_cell_size;
+
+void fft1d(double *a, int n, int sign) {
+	//in-place radix-2 transform of n complex values
+	for (int i=1,j=0;i<n;i++) {
+		int bit=n>>1;
+		for (;j&bit;bit>>=1) j^=bit;
+		j^=bit;
+		if (i<j) {
+			double t;
+			t=a[2*i];   a[2*i]=a[2*j];     a[2*j]=t;
+			t=a[2*i+1]; a[2*i+1]=a[2*j+1]; a[2*j+1]=t;
+		}
+	}
+	for (int len=2;len<=n;len<<=1) {
+		double ang=sign*2*M_PI/len;
+		double wr=cos(ang), wi=sin(ang);
+		for (int i=0;i<n;i+=len) {
+			double cr=1, ci=0;
+			for (int k=0;k<len/2;k++) {
+				double *u=&a[2*(i+k)], *v=&a[2*(i+k+len/2)];
+				double vr=v[0]*cr-v[1]*ci;
+				double vi=v[0]*ci+v[1]*cr;
+				v[0]=u[0]-vr; v[1]=u[1]-vi;
+				u[0]+=vr;     u[1]+=vi;
+				double t=cr*wr-ci*wi;
+				ci=cr*wi+ci*wr;
+				cr=t;
+			}
+		}
+	}
+}
+
+void fft3d(double *a, int sign) {
+	int n=pm_np;
+	size_t stride[3]={(size_t)n*n,n,1};
+	for (int axis=0;axis<3;axis++) {
+		size_t s=stride[axis];
+		size_t o1=stride[(axis+1)%3], o2=stride[(axis+2)%3];
+		#pragma omp taskloop
+		for (int l=0;l<n*n;l++) {
+			double line[2*n];
+			size_t base=(l/n)*o1+(l%n)*o2;
+			for (int k=0;k<n;k++) {
+				line[2*k]  =a[2*(base+k*s)];
+				line[2*k+1]=a[2*(base+k*s)+1];
+			}
+			fft1d(line,n,sign);
+			for (int k=0;k<n;k++) {
+				a[2*(base+k*s)]  =line[2*k];
+				a[2*(base+k*s)+1]=line[2*k+1];
+			}
+		}
+	}
+}
+
+double pm_long_potential(double r) {
+	//potential of the long-range part: D/r, softened inside the split radius
+	double D=params.coulomb_constant;
+	double rs=pm_split_radius;
+	if (r>=rs) return D/r;
+	return D*(3*rs*rs-r*r)/(2*rs*rs*rs);
+}
+
+void pm_setup() {
+	pm_n=params.pm_grid;
+	if (pm_n<4 || (pm_n&(pm_n-1))!=0) {
+		printf("particle mesh size %d is not a power of two\n",pm_n);
+		exit(-1);
+	}
+	pm_np=2*pm_n;
+	double l[3]={params.lx,params.ly,params.lz};
+	double hmax=0;
+	for (int d=0;d<3;d++) {
+		pm_h[d]=l[d]/pm_n;
+		pm_lo[d]=-l[d]/2;
+		hmax=MAX(hmax,pm_h[d]);
+	}
+	pm_split_radius=MAX(params.coulomb_radius,PM_SPLIT_CELLS*hmax);
+	size_t np3=(size_t)pm_np*pm_np*pm_np;
+	pm_green=mem_malloc(MEM_FORCES,2*np3*sizeof(double));
+	pm_rho=mem_malloc(MEM_FORCES,2*np3*sizeof(double));
+	pm_phi=mem_malloc(MEM_FORCES,(size_t)pm_n*pm_n*pm_n*sizeof(double));
+	//kernel on the periodic padded mesh, offsets wrap around at pm_n
+	#pragma omp taskloop
+	for (int i=0;i<pm_np;i++) {
+		double dx=(i<=pm_n?i:i-pm_np)*pm_h[0];
+		for (int j=0;j<pm_np;j++) {
+			double dy=(j<=pm_n?j:j-pm_np)*pm_h[1];
+			for (int k=0;k<pm_np;k++) {
+				double dz=(k<=pm_n?k:k-pm_np)*pm_h[2];
+				size_t idx=((size_t)i*pm_np+j)*pm_np+k;
+				pm_green[2*idx]=pm_long_potential(sqrt(dx*dx+dy*dy+dz*dz));
+				pm_green[2*idx+1]=0;
+			}
+		}
+	}
+	fft3d(pm_green,-1);
+	printf("particle mesh: %d^3 cells, split radius %f\n",pm_n,pm_split_radius);
+}
+
+void pm_cic(compute_t x, compute_t y, compute_t z, int i0[3], double w[3]) {
+	//cloud-in-cell weights with mesh points at the cell centres
+	compute_t p[3]={x,y,z};
+	for (int d=0;d<3;d++) {
+		double u=(p[d]-pm_lo[d])/pm_h[d]-0.5;
+		int i=floor(u);
+		if (i<0) {i=0; u=0;}
+		if (i>pm_n-2) {i=pm_n-2; u=pm_n-1;}
+		i0[d]=i;
+		w[d]=u-i;
+	}
+}
+
+void pm_long_range(struct insect_action_data *out) {
+	int n=pm_n, np=pm_np;
+	size_t np3=(size_t)np*np*np;
+	memset(pm_rho,0,2*np3*sizeof(double));
+	//deposit unit charges
+	#pragma omp taskloop
+	for (int p=0;p<NumInsects;p++) {
+		int i0[3]; double w[3];
+		pm_cic(insects[p].x,insects[p].y,insects[p].z,i0,w);
+		for (int c=0;c<8;c++) {
+			int a=c>>2&1, b=c>>1&1, e=c&1;
+			double wc=(a?w[0]:1-w[0])*(b?w[1]:1-w[1])*(e?w[2]:1-w[2]);
+			size_t idx=((size_t)(i0[0]+a)*np+i0[1]+b)*np+i0[2]+e;
+			#pragma omp atomic
+			pm_rho[2*idx]+=wc;
+		}
+	}
+	//convolve with the kernel
+	fft3d(pm_rho,-1);
+	#pragma omp taskloop
+	for (size_t idx=0;idx<np3;idx++) {
+		double ar=pm_rho[2*idx], ai=pm_rho[2*idx+1];
+		double br=pm_green[2*idx], bi=pm_green[2*idx+1];
+		pm_rho[2*idx]  =ar*br-ai*bi;
+		pm_rho[2*idx+1]=ar*bi+ai*br;
+	}
+	fft3d(pm_rho,+1);
+	#pragma omp taskloop
+	for (int i=0;i<n;i++)
+		for (int j=0;j<n;j++)
+			for (int k=0;k<n;k++)
+				pm_phi[((size_t)i*n+j)*n+k]=pm_rho[2*(((size_t)i*np+j)*np+k)]/np3;
+
+	//interpolate the field back, the field at mesh points is the central
+	//difference of the potential
+	double self=pm_long_potential(0);
+	#pragma omp taskloop
+	for (int p=0;p<NumInsects;p++) {
+		if (insects[p].leader_idx<0) continue;
+		int i0[3]; double w[3];
+		pm_cic(insects[p].x,insects[p].y,insects[p].z,i0,w);
+		double f[3]={0,0,0}, phi=0;
+		for (int c=0;c<8;c++) {
+			int g[3]={i0[0]+(c>>2&1),i0[1]+(c>>1&1),i0[2]+(c&1)};
+			double wc=((c>>2&1)?w[0]:1-w[0])*((c>>1&1)?w[1]:1-w[1])*((c&1)?w[2]:1-w[2]);
+			phi+=wc*pm_phi[((size_t)g[0]*n+g[1])*n+g[2]];
+			for (int d=0;d<3;d++) {
+				int gm[3]={g[0],g[1],g[2]}, gp[3]={g[0],g[1],g[2]};
+				gm[d]=MAX(g[d]-1,0);
+				gp[d]=MIN(g[d]+1,n-1);
+				double dphi=pm_phi[((size_t)gp[0]*n+gp[1])*n+gp[2]]-pm_phi[((size_t)gm[0]*n+gm[1])*n+gm[2]];
+				f[d]-=wc*dphi/((gp[d]-gm[d])*pm_h[d]);
+			}
+		}
+		out[p].fx+=f[0];
+		out[p].fy+=f[1];
+		out[p].fz+=f[2];
+		out[p].ep+=0.5*(phi-self);
+	}
+}
+
+void pm_build_cells() {
+	compute_t lo[3]={+INFINITY,+INFINITY,+INFINITY}, hi[3]={-INFINITY,-INFINITY,-INFINITY};
+	for (int i=0;i<NumInsects;i++) {
+		compute_t p[3]={insects[i].x,insects[i].y,insects[i].z};
+		for (int d=0;d<3;d++) {
+			lo[d]=MIN(lo[d],p[d]);
+			hi[d]=MAX(hi[d],p[d]);
+		}
+	}
+	//cells no smaller than the split radius, and at most 256 per dimension
+	pm_cell_size=pm_split_radius;
+	for (int d=0;d<3;d++)
+		pm_cell_size=MAX(pm_cell_size,(hi[d]-lo[d])/255);
+	int ncells=1;
+	for (int d=0;d<3;d++) {
+		pm_cell_lo[d]=lo[d];
+		pm_ncells[d]=1+(int)((hi[d]-lo[d])/pm_cell_size);
+		ncells*=pm_ncells[d];
+	}
+	pm_cell_start=mem_realloc(MEM_FORCES,pm_cell_start,(ncells+1)*sizeof(int));
+	if (pm_cell_insects==NULL) pm_cell_insects=mem_malloc(MEM_FORCES,NumInsects*sizeof(int));
+	memset(pm_cell_start,0,(ncells+1)*sizeof(int));
+	int *cell=mem_malloc(MEM_FORCES,NumInsects*sizeof(int));
+	for (int i=0;i<NumInsects;i++) {
+		compute_t p[3]={insects[i].x,insects[i].y,insects[i].z};
+		int c=0;
+		for (int d=0;d<3;d++)
+			c=c*pm_ncells[d]+MIN((int)((p[d]-pm_cell_lo[d])/pm_cell_size),pm_ncells[d]-1);
+		cell[i]=c;
+		pm_cell_start[c+1]++;
+	}
+	for (int c=0;c<ncells;c++)
+		pm_cell_start[c+1]+=pm_cell_start[c];
+	for (int i=0;i<NumInsects;i++)
+		pm_cell_insects[pm_cell_start[cell[i]]++]=i;
+	//the fill moved each start to the start of the next cell
+	for (int c=ncells;c>0;c--)
+		pm_cell_start[c]=pm_cell_start[c-1];
+	pm_cell_start[0]=0;
+	mem_free(cell);
+}
+
+void pm_short_range(struct insect_action_data *out) {
+	//exact capped force minus the long-range part, non-zero inside the split radius
+	compute_t D=params.coulomb_constant;
+	compute_t r0=params.coulomb_radius;
+	compute_t rs=pm_split_radius;
+	pm_build_cells();
+	#pragma omp taskloop grainsize(64)
+	for (int i=0;i<NumInsects;i++) {
+		if (insects[i].leader_idx<0) continue;
+		compute_t xi=insects[i].x, yi=insects[i].y, zi=insects[i].z;
+		int ci[3]={
+			MIN((int)((xi-pm_cell_lo[0])/pm_cell_size),pm_ncells[0]-1),
+			MIN((int)((yi-pm_cell_lo[1])/pm_cell_size),pm_ncells[1]-1),
+			MIN((int)((zi-pm_cell_lo[2])/pm_cell_size),pm_ncells[2]-1)};
+		compute_t fx=0,fy=0,fz=0,ep=0;
+		int npairs=0;
+		for (int a=MAX(ci[0]-1,0);a<=MIN(ci[0]+1,pm_ncells[0]-1);a++)
+		for (int b=MAX(ci[1]-1,0);b<=MIN(ci[1]+1,pm_ncells[1]-1);b++)
+		for (int c=MAX(ci[2]-1,0);c<=MIN(ci[2]+1,pm_ncells[2]-1);c++) {
+			int cell=(a*pm_ncells[1]+b)*pm_ncells[2]+c;
+			npairs+=pm_cell_start[cell+1]-pm_cell_start[cell];
+			for (int s=pm_cell_start[cell];s<pm_cell_start[cell+1];s++) {
+				int j=pm_cell_insects[s];
+				if (j==i) continue;
+				compute_t dx=xi-insects[j].x;
+				compute_t dy=yi-insects[j].y;
+				compute_t dz=zi-insects[j].z;
+				compute_t r=sqrt(dx*dx+dy*dy+dz*dz);
+				if (r>=rs) continue;
+				compute_t rr=MAX(r,r0);
+				compute_t f=D/(rr*rr*rr)-D/(rs*rs*rs);
+				fx+=dx*f;
+				fy+=dy*f;
+				fz+=dz*f;
+				compute_t exact=D/(rr*rr*rr)*(1.5*rr*rr-0.5*r*r);
+				ep+=0.5*(exact-pm_long_potential(r));
+			}
+		}
+		out[i].fx+=fx;
+		out[i].fy+=fy;
+		out[i].fz+=fz;
+		out[i].ep+=ep;
+		COUNT(COUNTER_COULOMB_PAIRS,npairs);
+	}
+}
+
+void pm_coulomb_repell(struct insect_action_data *out) {
+	if (pm_green==NULL) pm_setup();
+	pm_long_range(out);
+	pm_short_range(out);
+}
@@ -0,0 +1,17 @@
+#ifndef PM_H
+#define PM_H
+
+#include "model.h"
+
+// particle-mesh solver for the coulomb repulsion
+// the capped coulomb kernel is split at the radius pm_split_radius into a
+// smooth long-range part, solved on a params.pm_grid^3 mesh covering the
+// lx*ly*lz box with zero-padded (free space) FFT convolution, and a
+// short-range remainder that is summed directly over neighbouring cells
+// insects outside the box are clamped to its boundary cells for the mesh part
+
+extern compute_t pm_split_radius;
+
+void pm_coulomb_repell(struct insect_action_data *out);
+
+#endif
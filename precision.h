@@ -0,0 +1,35 @@
+#ifndef PRECISION_H
+#define PRECISION_H
+
+// compile-time precision policy, chosen with PRECISION in the Makefile
+// storage_t:  positions and masses of the insects
+// velocity_t: their velocities, _Float16 halves their share of the traffic
+// compute_t:  the force kernels, and the forces and energies per insect
+// accum_t:    the sums over all insects in the analyses
+
+#ifndef PRECISION_STORAGE
+#define PRECISION_STORAGE float
+#endif
+#ifndef PRECISION_VELOCITY
+#define PRECISION_VELOCITY PRECISION_STORAGE
+#endif
+#ifndef PRECISION_COMPUTE
+#define PRECISION_COMPUTE float
+#endif
+#ifndef PRECISION_ACCUM
+#define PRECISION_ACCUM double
+#endif
+
+typedef PRECISION_STORAGE storage_t;
+typedef PRECISION_VELOCITY velocity_t;
+typedef PRECISION_COMPUTE compute_t;
+typedef PRECISION_ACCUM accum_t;
+
+#define PRECISION_STR2(a) #a
+#define PRECISION_STR(a) PRECISION_STR2(a)
+#define PRECISION_NAME "storage " PRECISION_STR(PRECISION_STORAGE) \
+	", velocity " PRECISION_STR(PRECISION_VELOCITY) \
+	", compute " PRECISION_STR(PRECISION_COMPUTE) \
+	", accumulation " PRECISION_STR(PRECISION_ACCUM)
+
+#endif
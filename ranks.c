@@ -0,0 +1,87 @@
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef USE_MPI
+#include <mpi.h>
+#endif
+
+#include "model.h"
+#include "support.h"
+#include "ranks.h"
+
+int mpi_rank=0, mpi_size=1;
+
+int *ranks_rows;      // insects with a leader, without half pairs
+compute_t *ranks_buf; // fx,fy,fz,ep per insect, summed over the ranks
+
+void setup_ranks() {
+#ifdef USE_MPI
+	int provided;
+	//the coulomb task may run on any thread, but only one at a time
+	MPI_Init_thread(NULL,NULL,MPI_THREAD_SERIALIZED,&provided);
+	if (provided<MPI_THREAD_SERIALIZED) {
+		printf("MPI does not support MPI_THREAD_SERIALIZED\n");
+		MPI_Abort(MPI_COMM_WORLD,-1);
+	}
+	MPI_Comm_rank(MPI_COMM_WORLD,&mpi_rank);
+	MPI_Comm_size(MPI_COMM_WORLD,&mpi_size);
+	if (mpi_rank==0)
+		printf("%d ranks\n",mpi_size);
+#endif
+}
+
+void done_ranks() {
+#ifdef USE_MPI
+	MPI_Finalize();
+#endif
+}
+
+void ranks_coulomb_repell(struct insect_action_data *out) {
+	//the coulomb repulsion into the cleared out, on all ranks
+	int n=NumInsects;
+	if (ranks_buf==NULL)
+		ranks_buf=mem_malloc(MEM_FORCES,4*n*sizeof(compute_t));
+	if (params.coulomb_half_pairs) {
+		//an equal share of the tile pairs per rank
+		struct coulomb_batch b=coulomb_batch_of_model(out);
+		long long npairs=b.p1;
+		b.p0=npairs*mpi_rank/mpi_size;
+		b.p1=npairs*(mpi_rank+1)/mpi_size;
+		coulomb_half_pairs_batch(&b,1);
+	} else {
+		//an equal share of the rows with a leader per rank
+		if (ranks_rows==NULL)
+			ranks_rows=mem_malloc(MEM_FORCES,n*sizeof(int));
+		int nrows=0;
+		for (int i=0;i<n;i++)
+			if (insects[i].leader_idx>=0)
+				ranks_rows[nrows++]=i;
+		int r0=(long long)nrows*mpi_rank/mpi_size;
+		int r1=(long long)nrows*(mpi_rank+1)/mpi_size;
+		#pragma omp taskloop
+		for (int r=r0;r<r1;r++)
+			coulomb_repell(ranks_rows[r],out);
+	}
+	#pragma omp taskloop
+	for (int i=0;i<n;i++) {
+		ranks_buf[4*i]  =out[i].fx;
+		ranks_buf[4*i+1]=out[i].fy;
+		ranks_buf[4*i+2]=out[i].fz;
+		ranks_buf[4*i+3]=out[i].ep;
+	}
+#ifdef USE_MPI
+	//with rows every insect has one non-zero contribution, so the sum is
+	//exact; with half pairs it is summed over the ranks in MPI's order
+	int s=section_start("coulomb exchange");
+	MPI_Datatype type=sizeof(compute_t)==sizeof(double)?MPI_DOUBLE:MPI_FLOAT;
+	MPI_Allreduce(MPI_IN_PLACE,ranks_buf,4*n,type,MPI_SUM,MPI_COMM_WORLD);
+	section_end(s);
+#endif
+	#pragma omp taskloop
+	for (int i=0;i<n;i++) {
+		out[i].fx=ranks_buf[4*i];
+		out[i].fy=ranks_buf[4*i+1];
+		out[i].fz=ranks_buf[4*i+2];
+		out[i].ep=ranks_buf[4*i+3];
+	}
+}
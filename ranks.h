@@ -0,0 +1,25 @@
+#ifndef RANKS_H
+#define RANKS_H
+
+#include "model.h"
+
+// replicated-data force splitting over MPI ranks (make MPI=1)
+// this is not a spatial decomposition: every rank keeps the whole model and
+// advances it identically, so there are no slabs, halos or migrations, and
+// desertions need no communication. Only the coulomb repulsion, the O(N^2)
+// term, is split: with COULOMB_HALF_PAIRS every rank evaluates an equal
+// share of the half-pair tiles, otherwise an equal share of the rows, and
+// the per-insect results are summed over the ranks. The other terms are
+// O(N) and replicated. This does not scale like a decomposition would:
+// * every rank holds the memory of the whole model, as a single process does
+// * the sum is an MPI_Allreduce of 4 values per insect on every slow step,
+//   whatever the number of ranks, so it is O(N) per rank and outgrows the
+//   shrinking O(N^2/ranks) share of pairs as ranks are added
+
+extern int mpi_rank, mpi_size;
+
+void setup_ranks();
+void done_ranks();
+void ranks_coulomb_repell(struct insect_action_data *out);
+
+#endif
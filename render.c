@@ -6,7 +6,8 @@
 
 #include "model.h"
 #include "support.h"
-#include "writepng.h"
+#include "render.h"
+#include "output.h"
 
 #define M_PI 3.14159265358979323846
 
@@ -57,17 +58,17 @@ void drawLine(struct image* img, float x1, float y1, float z1, float x2, float y
 	}
 }
 void destroyImage(struct image* img) {
-	free(img->buffer);
-	free(img);
+	mem_free(img->buffer);
+	mem_free(img);
 }
 
-struct image* createImage(int width, int height, float angle, float max)
+struct image* createImage(const struct frame *f, int width, int height, float angle, float max)
 {
-	struct image* img = (struct image*) malloc(sizeof(struct image));
+	struct image* img = (struct image*) mem_malloc(MEM_IMAGES,sizeof(struct image));
 	img->width=width;
 	img->height=height;
 	int bufsize=width * height * sizeof(struct rgb);
-	img->buffer= (struct rgb *) malloc(bufsize);
+	img->buffer= (struct rgb *) mem_malloc(MEM_IMAGES,bufsize);
 	if (img->buffer == NULL) {
 		fprintf(stderr, "Could not create image buffer\n");
 		return NULL;
@@ -87,39 +88,133 @@ struct image* createImage(int width, int height, float angle, float max)
 	drawLine(img,0,-max,0,0,max,0,rgb,scale,ca,sa);
 	drawLine(img,0,0,-max,0,0,max,rgb,scale,ca,sa);
 
-	for (int i=0;i<NumInsects;i++) {
+	for (int i=0;i<f->num_insects;i++) {
 		hsv.s=1;
 		hsv.v=0.2;
 		hsv.h=0;
-		int leader_id=insects[i].leader_id;
+		int leader_id=f->leader_id[i];
 		if (leader_id!=-1) {
-			hsv.h=leaders[leader_id].hue;
+			hsv.h=f->hue[leader_id];
 		}
 		rgb=hsv2rgb(hsv);
-		struct insect_data *pi,*pj;
-		pi=&insects[i];
-		if (pi->parent>=0) {
-			pj=&insects[pi->parent];
-			drawLine(img,pi->x,pi->y,pi->z,pj->x,pj->y,pj->z,rgb,scale,ca,sa);
+		int j=f->parent[i];
+		if (j>=0) {
+			drawLine(img,f->x[i],f->y[i],f->z[i],f->x[j],f->y[j],f->z[j],rgb,scale,ca,sa);
 		}
 	}
 	return img;
 }
 
-void save_image(int i) 
+struct image* render_frame(const struct frame *f, float scale)
+{
+	//even sizes, as the video encoder needs them
+	int width = MAX(16,(int)(960*scale+0.5)*2);
+	int height = MAX(16,(int)(540*scale+0.5)*2);
+	float max = 80;
+	float angle=2*M_PI*f->iteration/720;
+	return createImage(f,width,height,angle,max);
+}
+
+double save_image(const struct frame *f, float scale)
 {
 	const char* title="";
 	int s=section_start("image");
-	int width = 1920;
-	int height = 1080;
-	float max = 80;
+	int i=f->iteration;
         char filename[1024];
-        sprintf(filename,"%s/iteration.%04d.png",params.output_dir,i);
-	float angle=2*M_PI*i/720;
-	struct image* img = createImage(width,height,angle,max);
+        sprintf(filename,"%s/iteration.%04d.png",f->output_dir,i);
+	struct image* img = render_frame(f,scale);
 	//normalizeImage(a,a,buffer);
 	int result = writeImage(filename, img, title);
 	destroyImage(img);
 	section_end(s);
+	return sections[s].end-sections[s].start;
+}
+// the video's frame rate, the duration of one iteration
+#define VIDEO_FPS 30
+
+void render_policy_init(struct render_policy *p, const struct model_parameters *params) {
+	memset(p,0,sizeof(*p));
+	p->every=MAX(1,params->render_every);
+	p->scale=params->render_scale;
+	p->budget=params->render_budget;
+	p->stride=p->every;
+	p->current_scale=p->scale;
+	p->last_rendered=-1;
+	char filename[1024];
+	sprintf(filename,"%s/frames.ffconcat",params->output_dir);
+	p->concat=output_fopen(filename);
+	if (p->concat==NULL) {
+		printf("cannot open %s\n",filename);
+		exit(-1);
+	}
+	fprintf(p->concat,"ffconcat version 1.0\n");
+}
+
+void adapt_render_policy(struct render_policy *p) {
+	//a frame per stride iterations may take budget*stride iterations;
+	//over the budget, render less often, and at the largest stride at a
+	//lower resolution; well under it, undo the reductions in reverse
+	double allowed=p->budget*p->iteration_time*p->stride;
+	if (p->render_time>allowed) {
+		if (p->stride<p->every*RENDER_MAX_STRIDE)
+			p->stride*=2;
+		else if (p->current_scale>RENDER_MIN_SCALE*p->scale)
+			p->current_scale=MAX(RENDER_MIN_SCALE*p->scale,p->current_scale*0.7071f);
+	} else if (p->render_time<0.4*allowed) {
+		if (p->current_scale<p->scale)
+			p->current_scale=MIN(p->scale,p->current_scale*1.4142f);
+		else if (p->stride>p->every)
+			p->stride/=2;
+	}
 }
 
+float render_due(struct render_policy *p, int iteration) {
+	//the resolution scale to render the iteration's frame at, 0 to skip it;
+	//called once per iteration, in order
+	float scale=0;
+	double t=now();
+	#pragma omp critical(render_policy)
+	{
+		if (iteration>0)
+			p->iteration_time=(p->iteration_time==0)?t-p->last_start:0.8*p->iteration_time+0.2*(t-p->last_start);
+		p->last_start=t;
+		if (iteration%p->stride==0) {
+			if (p->budget>0 && p->render_time>0 && p->iteration_time>0)
+				adapt_render_policy(p);
+			if (iteration%p->stride==0)
+				scale=p->current_scale;
+		}
+	}
+	return scale;
+}
+
+void render_policy_concat(struct render_policy *p, int iteration) {
+	//the duration of the previous frame lasts until this one
+	if (p->last_rendered>=0)
+		fprintf(p->concat,"duration %g\n",(double)(iteration-p->last_rendered)/VIDEO_FPS);
+	fprintf(p->concat,"file 'iteration.%04d.png'\n",iteration);
+	p->last_rendered=iteration;
+}
+
+double render_policy_frame(struct render_policy *p, const struct frame *f, float scale) {
+	//renders and saves a frame that render_due() selected, in order
+	double t=save_image(f,scale);
+	#pragma omp critical(render_policy)
+	{
+		p->render_time=(p->render_time==0)?t:0.8*p->render_time+0.2*t;
+		render_policy_concat(p,f->iteration);
+		p->num_rendered++;
+	}
+	return t;
+}
+
+void render_policy_done(struct render_policy *p, int num_iterations) {
+	//the last frame lasts until the end; the concat demuxer ignores the
+	//duration of the last entry, so it is listed once more
+	if (p->last_rendered>=0) {
+		fprintf(p->concat,"duration %g\n",(double)(num_iterations-p->last_rendered)/VIDEO_FPS);
+		fprintf(p->concat,"file 'iteration.%04d.png'\n",p->last_rendered);
+	}
+	fclose(p->concat);
+	printf("rendered %d of %d frames\n",p->num_rendered,num_iterations);
+}
@@ -1,2 +1,37 @@
+#include "frame.h"
+#include "model.h"
+#include "writepng.h"
 
-void save_image(int index);
+#include <stdio.h>
+
+struct image* render_frame(const struct frame *f, float scale);
+void destroyImage(struct image* img);
+
+double save_image(const struct frame *f, float scale);
+
+// which frames are rendered, and at which resolution. Frames are rendered
+// every render_every iterations; with a render_budget, the stride and the
+// resolution adapt so that rendering takes at most that fraction of the
+// iteration time. The rendered frames and their durations are listed in
+// frames.ffconcat for the video.
+#define RENDER_MAX_STRIDE 64        // in multiples of render_every
+#define RENDER_MIN_SCALE 0.25f
+
+struct render_policy {
+	int every;                   // render_every
+	float scale;                 // render_scale, the largest resolution
+	float budget;                // render_budget, 0 for a fixed cadence
+	int stride;                  // the current cadence, every*2^k
+	float current_scale;
+	double render_time;          // moving averages, s
+	double iteration_time;
+	double last_start;           // now() at the previous render_due()
+	int last_rendered;           // the last frame in the concat file, -1 for none
+	int num_rendered;
+	FILE *concat;
+};
+
+void render_policy_init(struct render_policy *p, const struct model_parameters *params);
+float render_due(struct render_policy *p, int iteration);
+double render_policy_frame(struct render_policy *p, const struct frame *f, float scale);
+void render_policy_done(struct render_policy *p, int num_iterations);
@@ -0,0 +1,136 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "model.h"
+#include "journal.h"
+
+// rebuilds the leadership tree of an iteration from a journal written with
+// JOURNAL=1, and prints the insects per leader as a line of log-leaders.txt,
+// or with "tree" the parent and leader of every insect
+
+int num_insects;
+int *parent, *leader_idx, *leader_id, *nchildren;
+int (*children)[MAX_CHILDREN+1];   // one more for a promotion in progress
+
+void detach(int p, int c) {
+	for (int k=0;k<nchildren[p];k++) {
+		if (children[p][k]==c) {
+			children[p][k]=children[p][--nchildren[p]];
+			return;
+		}
+	}
+	printf("insect %d not a child of %d\n",c,p);
+	exit(-1);
+}
+
+void attach(int p, int c) {
+	if (nchildren[p]==MAX_CHILDREN+1) {
+		printf("too many children of %d\n",p);
+		exit(-1);
+	}
+	children[p][nchildren[p]++]=c;
+}
+
+void make_leader(int idx, int l_idx, int l_id) {
+	leader_idx[idx]=l_idx;
+	leader_id[idx]=l_id;
+	for (int k=0;k<nchildren[idx];k++)
+		make_leader(children[idx][k],l_idx,l_id);
+}
+
+void apply(const struct journal_event *e) {
+	int i=e->insect;
+	if (e->old_parent!=e->new_parent) {
+		if (e->old_parent>=0)
+			detach(e->old_parent,i);
+		parent[i]=e->new_parent;
+		if (e->new_parent>=0)
+			attach(e->new_parent,i);
+	}
+	switch (e->kind) {
+	case JOURNAL_ADD:
+		make_leader(i,leader_idx[e->new_parent],leader_id[e->new_parent]);
+		break;
+	case JOURNAL_REMOVE:
+		leader_idx[i]=-1;
+		leader_id[i]=-1;
+		break;
+	case JOURNAL_MOVE:
+		break;
+	case JOURNAL_PROMOTE:
+		make_leader(i,i,e->leader_id);
+		break;
+	default:
+		printf("unknown journal event %d\n",e->kind);
+		exit(-1);
+	}
+	if (leader_id[i]!=e->leader_id) {
+		printf("journal inconsistent: insect %d has leader %d, recorded %d, iteration %d\n",i,leader_id[i],e->leader_id,e->iteration);
+		exit(-1);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	if (argc<3) {
+		printf("usage: %s <journal.bin> <iteration> [tree]\n",argv[0]);
+		exit(-1);
+	}
+	FILE *f=fopen(argv[1],"rb");
+	if (f==NULL) {
+		printf("cannot open %s\n",argv[1]);
+		exit(-1);
+	}
+	int iteration=atoi(argv[2]);
+	int tree=argc>3 && strcmp(argv[3],"tree")==0;
+
+	struct journal_header h;
+	if (fread(&h,sizeof(h),1,f)!=1 || memcmp(h.magic,JOURNAL_MAGIC,sizeof(h.magic))!=0) {
+		printf("%s is not a journal\n",argv[1]);
+		exit(-1);
+	}
+	num_insects=h.num_insects;
+	parent=malloc(num_insects*sizeof(int));
+	leader_idx=malloc(num_insects*sizeof(int));
+	leader_id=malloc(num_insects*sizeof(int));
+	nchildren=calloc(num_insects,sizeof(int));
+	children=malloc(num_insects*sizeof(*children));
+	for (int i=0;i<num_insects;i++) {
+		struct journal_insect s;
+		if (fread(&s,sizeof(s),1,f)!=1) {
+			printf("journal snapshot truncated\n");
+			exit(-1);
+		}
+		parent[i]=s.parent;
+		leader_idx[i]=s.leader_idx;
+		leader_id[i]=s.leader_id;
+	}
+	for (int i=0;i<num_insects;i++)
+		if (parent[i]>=0)
+			attach(parent[i],i);
+
+	struct journal_event e;
+	long long events=0;
+	while (fread(&e,sizeof(e),1,f)==1 && e.iteration<=iteration) {
+		apply(&e);
+		events++;
+	}
+	fclose(f);
+
+	if (tree) {
+		printf("# insect parent leader_id, iteration %d after %lld events\n",iteration,events);
+		for (int i=0;i<num_insects;i++)
+			printf("%d %d %d\n",i,parent[i],leader_id[i]);
+	} else {
+		int *counts=calloc(h.num_leaders,sizeof(int));
+		for (int i=0;i<num_insects;i++)
+			if (leader_id[i]>=0)
+				counts[leader_id[i]]++;
+		printf("%i ",iteration);
+		for (int l=0;l<h.num_leaders;l++)
+			printf(" %d",counts[l]);
+		printf("\n");
+	}
+	return 0;
+}
@@ -0,0 +1,144 @@
+#define _DEFAULT_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "shmframes.h"
+
+struct shm_frames_slot* shm_frames_slot(struct shm_frames *s, uint64_t k) {
+	return (struct shm_frames_slot*)(s->slots+(k%s->header->num_slots)*s->header->slot_size);
+}
+
+void shm_frames_view(struct shm_frames *s, struct shm_frames_slot *slot, struct frame *f) {
+	//arrays of a slot, pointing into the shared memory
+	int n=s->header->max_insects;
+	char *p=(char*)(slot+1);
+	f->x=(float*)p;                  p+=n*sizeof(float);
+	f->y=(float*)p;                  p+=n*sizeof(float);
+	f->z=(float*)p;                  p+=n*sizeof(float);
+	f->parent=(int*)p;               p+=n*sizeof(int);
+	f->leader_id=(int*)p;            p+=n*sizeof(int);
+	f->hue=(float*)p;
+}
+
+int shm_frames_create(struct shm_frames *s, const char *name, int num_slots, int max_insects, int max_leaders) {
+	uint64_t slot_size=sizeof(struct shm_frames_slot)+(uint64_t)max_insects*(3*sizeof(float)+2*sizeof(int))+max_leaders*sizeof(float);
+	slot_size=(slot_size+63)&~(uint64_t)63;
+	s->size=4096+num_slots*slot_size;
+	//a segment left by an earlier run is removed, consumers still attached to
+	//it keep their mapping, new ones only find this run's segment
+	shm_unlink(name);
+	int fd=shm_open(name,O_CREAT|O_EXCL|O_RDWR,0644);
+	if (fd<0) return -1;
+	if (ftruncate(fd,s->size)!=0) {
+		close(fd);
+		return -1;
+	}
+	void *p=mmap(NULL,s->size,PROT_READ|PROT_WRITE,MAP_SHARED,fd,0);
+	close(fd);
+	if (p==MAP_FAILED) return -1;
+	s->header=p;
+	s->slots=(char*)p+4096;
+	memset(s->header,0,sizeof(struct shm_frames_header));
+	s->header->num_slots=num_slots;
+	s->header->max_insects=max_insects;
+	s->header->max_leaders=max_leaders;
+	s->header->slot_size=slot_size;
+	s->header->producer=getpid();
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME,&ts);
+	s->header->run_id=((uint64_t)ts.tv_sec*1000000000+ts.tv_nsec)^((uint64_t)getpid()<<44);
+	for (int k=0;k<num_slots;k++)
+		shm_frames_slot(s,k)->seq=0;
+	__atomic_store_n(&s->header->magic,SHM_FRAMES_MAGIC,__ATOMIC_RELEASE);
+	return 0;
+}
+
+void shm_frames_publish(struct shm_frames *s, const struct frame *f) {
+	uint64_t k=s->header->write_count;
+	struct shm_frames_slot *slot=shm_frames_slot(s,k);
+	struct frame view;
+	shm_frames_view(s,slot,&view);
+	int n=f->num_insects, nl=f->num_leaders;
+	__atomic_store_n(&slot->seq,slot->seq+1,__ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	slot->iteration=f->iteration;
+	slot->num_insects=n;
+	slot->num_leaders=nl;
+	memcpy(view.x,f->x,n*sizeof(float));
+	memcpy(view.y,f->y,n*sizeof(float));
+	memcpy(view.z,f->z,n*sizeof(float));
+	memcpy(view.parent,f->parent,n*sizeof(int));
+	memcpy(view.leader_id,f->leader_id,n*sizeof(int));
+	memcpy(view.hue,f->hue,nl*sizeof(float));
+	__atomic_store_n(&slot->seq,slot->seq+1,__ATOMIC_RELEASE);
+	__atomic_store_n(&s->header->write_count,k+1,__ATOMIC_RELEASE);
+}
+
+void shm_frames_finish(struct shm_frames *s) {
+	__atomic_store_n(&s->header->finished,1,__ATOMIC_RELEASE);
+}
+
+void shm_frames_destroy(struct shm_frames *s, const char *name) {
+	munmap(s->header,s->size);
+	shm_unlink(name);
+}
+
+int shm_frames_producer_alive(struct shm_frames *s) {
+	pid_t pid=s->header->producer;
+	return kill(pid,0)==0 || errno==EPERM;
+}
+
+int shm_frames_attach(struct shm_frames *s, const char *name) {
+	int fd=shm_open(name,O_RDONLY,0);
+	if (fd<0) return -1;
+	struct stat st;
+	if (fstat(fd,&st)!=0 || st.st_size<4096) {
+		close(fd);
+		return -1;
+	}
+	s->size=st.st_size;
+	void *p=mmap(NULL,s->size,PROT_READ,MAP_SHARED,fd,0);
+	close(fd);
+	if (p==MAP_FAILED) return -1;
+	s->header=p;
+	s->slots=(char*)p+4096;
+	if (__atomic_load_n(&s->header->magic,__ATOMIC_ACQUIRE)!=SHM_FRAMES_MAGIC) {
+		munmap(p,s->size);
+		return -1;
+	}
+	//a finished or orphaned segment is stale, wait for the next run
+	if (__atomic_load_n(&s->header->finished,__ATOMIC_ACQUIRE) || !shm_frames_producer_alive(s)) {
+		munmap(p,s->size);
+		return -1;
+	}
+	return 0;
+}
+
+uint64_t shm_frames_latest(struct shm_frames *s, struct frame *view) {
+	//returns the slot sequence to validate the view with, 0 if there is no frame
+	uint64_t count=__atomic_load_n(&s->header->write_count,__ATOMIC_ACQUIRE);
+	if (count==0) return 0;
+	struct shm_frames_slot *slot=shm_frames_slot(s,count-1);
+	uint64_t seq=__atomic_load_n(&slot->seq,__ATOMIC_ACQUIRE);
+	if (seq&1) return 0;
+	view->output_dir=NULL;
+	view->iteration=slot->iteration;
+	view->num_insects=slot->num_insects;
+	view->num_leaders=slot->num_leaders;
+	shm_frames_view(s,slot,view);
+	return seq;
+}
+
+int shm_frames_valid(struct shm_frames *s, const struct frame *view, uint64_t seq) {
+	//the view is valid if its slot has not been written since shm_frames_latest()
+	struct shm_frames_slot *slot=(struct shm_frames_slot*)((char*)view->x-sizeof(struct shm_frames_slot));
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(&slot->seq,__ATOMIC_RELAXED)==seq;
+}
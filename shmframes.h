@@ -0,0 +1,55 @@
+#ifndef SHMFRAMES_H
+#define SHMFRAMES_H
+
+#include <stdint.h>
+
+#include "frame.h"
+
+// ring buffer of frames in POSIX shared memory
+// the simulation publishes every frame into the next slot and never waits.
+// Each slot carries a sequence counter that is odd while the slot is being
+// written, so a consumer can use the slot in place and afterwards check
+// whether it has been overwritten in the meantime. Slow consumers just skip
+// frames. Every run creates the segment anew and removes its name when it is
+// done; a consumer ignores segments whose run has finished or whose producer
+// is gone, so it never shows the frames of an earlier run.
+
+#define SHM_FRAMES_MAGIC 0x46524d32u
+
+struct shm_frames_header {
+	uint32_t magic;
+	int32_t num_slots;
+	int32_t max_insects;
+	int32_t max_leaders;
+	uint64_t slot_size;          // bytes per slot, including the slot header
+	uint64_t write_count;        // number of frames published so far
+	int32_t finished;            // set when the producer is done
+	int32_t producer;            // pid of the producer
+	uint64_t run_id;             // different for every run
+};
+
+struct shm_frames_slot {
+	uint64_t seq;                // odd while the slot is written
+	int32_t iteration;
+	int32_t num_insects;
+	int32_t num_leaders;
+	// followed by x,y,z,hue as float and parent,leader_id as int
+};
+
+struct shm_frames {
+	struct shm_frames_header *header;
+	char *slots;
+	size_t size;
+};
+
+int shm_frames_create(struct shm_frames *s, const char *name, int num_slots, int max_insects, int max_leaders);
+void shm_frames_publish(struct shm_frames *s, const struct frame *f);
+void shm_frames_finish(struct shm_frames *s);
+void shm_frames_destroy(struct shm_frames *s, const char *name);
+
+int shm_frames_attach(struct shm_frames *s, const char *name);
+uint64_t shm_frames_latest(struct shm_frames *s, struct frame *view);
+int shm_frames_valid(struct shm_frames *s, const struct frame *view, uint64_t seq);
+int shm_frames_producer_alive(struct shm_frames *s);
+
+#endif
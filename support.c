@@ -1,7 +1,14 @@
+#define _DEFAULT_SOURCE
 #include <stdlib.h>
 #include <sys/time.h>
 #include <stdarg.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 #include "support.h"
 
@@ -10,7 +17,164 @@ int getenvl(const char* name, int def) {
   if (a) return atol(a); else return def;
 }
 
+double getenvd(const char* name, double def) {
+  char *a=getenv(name);
+  if (a) return atof(a); else return def;
+}
+
+int max_threads() {
+#ifdef _OPENMP
+	return omp_get_max_threads();
+#else
+	return 1;
+#endif
+}
+
+int num_threads() {
+#ifdef _OPENMP
+	return omp_get_num_threads();
+#else
+	return 1;
+#endif
+}
+
+int thread_num() {
+#ifdef _OPENMP
+	return omp_get_thread_num();
+#else
+	return 0;
+#endif
+}
+
 void setup_devices() {
+	setup_counters();
+}
+
+const char *counter_names[NUM_COUNTERS]={
+	"coulomb_pairs", "enemy_tests", "engagements", "fights", "desertions", "add_child_overflows",
+	"device_bytes_to", "device_bytes_from", "kicks"
+};
+long long *counter_rows;
+int counter_nrows;
+
+void setup_counters() {
+	counter_nrows=max_threads();
+	if (posix_memalign((void**)&counter_rows,64,counter_nrows*COUNTER_ROW*sizeof(long long))!=0) {
+		printf("cannot allocate counters\n");
+		exit(-1);
+	}
+	memset(counter_rows,0,counter_nrows*COUNTER_ROW*sizeof(long long));
+}
+
+void counters_collect(long long *totals) {
+	//sums the counts since the last call and starts counting anew
+	for (int c=0;c<NUM_COUNTERS;c++)
+		totals[c]=0;
+	for (int t=0;t<counter_nrows;t++) {
+		for (int c=0;c<NUM_COUNTERS;c++) {
+			totals[c]+=counter_rows[t*COUNTER_ROW+c];
+			counter_rows[t*COUNTER_ROW+c]=0;
+		}
+	}
+}
+
+const char *mem_subsystem_names[NUM_MEM_SUBSYSTEMS]={
+	"model", "forces", "enemies", "analysis", "frames", "images", "output"
+};
+static long long mem_bytes[NUM_MEM_SUBSYSTEMS+1];
+static long long mem_peak[NUM_MEM_SUBSYSTEMS+1];
+static long long mem_allocs[NUM_MEM_SUBSYSTEMS+1];
+
+// in front of every tracked block, 16 bytes keep the block aligned as malloc's
+struct mem_header {
+	size_t size;
+	int subsystem;
+	int pad;
+};
+
+static void mem_count(int subsystem, long long delta, int allocs) {
+	//frames, images and output buffers come and go on the output tasks
+	int s[2]={subsystem,NUM_MEM_SUBSYSTEMS};
+	for (int k=0;k<2;k++) {
+		long long b=__atomic_add_fetch(&mem_bytes[s[k]],delta,__ATOMIC_RELAXED);
+		long long p=__atomic_load_n(&mem_peak[s[k]],__ATOMIC_RELAXED);
+		while (b>p && !__atomic_compare_exchange_n(&mem_peak[s[k]],&p,b,1,__ATOMIC_RELAXED,__ATOMIC_RELAXED));
+		if (allocs) __atomic_add_fetch(&mem_allocs[s[k]],allocs,__ATOMIC_RELAXED);
+	}
+}
+
+void *mem_malloc(int subsystem, size_t size) {
+	struct mem_header *h=malloc(sizeof(struct mem_header)+size);
+	if (h==NULL) return NULL;
+	h->size=size;
+	h->subsystem=subsystem;
+	mem_count(subsystem,size,1);
+	return h+1;
+}
+
+void *mem_calloc(int subsystem, size_t n, size_t size) {
+	struct mem_header *h=calloc(1,sizeof(struct mem_header)+n*size);
+	if (h==NULL) return NULL;
+	h->size=n*size;
+	h->subsystem=subsystem;
+	mem_count(subsystem,n*size,1);
+	return h+1;
+}
+
+void *mem_realloc(int subsystem, void *p, size_t size) {
+	if (p==NULL) return mem_malloc(subsystem,size);
+	struct mem_header *h=(struct mem_header*)p-1;
+	size_t old=h->size;
+	subsystem=h->subsystem;
+	h=realloc(h,sizeof(struct mem_header)+size);
+	if (h==NULL) return NULL;
+	h->size=size;
+	mem_count(subsystem,(long long)size-(long long)old,1);
+	return h+1;
+}
+
+void mem_free(void *p) {
+	if (p==NULL) return;
+	struct mem_header *h=(struct mem_header*)p-1;
+	mem_count(h->subsystem,-(long long)h->size,0);
+	free(h);
+}
+
+void mem_collect(struct mem_usage *u) {
+	for (int s=0;s<=NUM_MEM_SUBSYSTEMS;s++) {
+		u->bytes[s]=__atomic_load_n(&mem_bytes[s],__ATOMIC_RELAXED);
+		u->peak[s]=__atomic_load_n(&mem_peak[s],__ATOMIC_RELAXED);
+		u->allocs[s]=__atomic_exchange_n(&mem_allocs[s],0,__ATOMIC_RELAXED);
+	}
+	//resident pages from /proc, the peak from the kernel's accounting
+	u->rss_kb=0;
+	FILE *f=fopen("/proc/self/statm","r");
+	if (f) {
+		long size,resident;
+		if (fscanf(f,"%ld %ld",&size,&resident)==2)
+			u->rss_kb=resident*(sysconf(_SC_PAGESIZE)/1024);
+		fclose(f);
+	}
+	struct rusage ru;
+	getrusage(RUSAGE_SELF,&ru);
+	u->peak_rss_kb=MAX(ru.ru_maxrss,u->rss_kb);
+}
+
+static inline uint64_t splitmix64(uint64_t z) {
+	z=(z^(z>>30))*0xbf58476d1ce4e5b9ULL;
+	z=(z^(z>>27))*0x94d049bb133111ebULL;
+	return z^(z>>31);
+}
+
+uint64_t rng_hash(uint64_t seed, uint64_t stream, uint64_t counter) {
+	uint64_t z=splitmix64(seed+0x9e3779b97f4a7c15ULL);
+	z=splitmix64(z^(stream*0x9e3779b97f4a7c15ULL+0x632be59bd9b4e019ULL));
+	return splitmix64(z+counter*0x9e3779b97f4a7c15ULL);
+}
+
+double rng_uniform01(uint64_t seed, uint64_t stream, uint64_t counter) {
+	//53 random bits mapped to [0,1]
+	return (rng_hash(seed,stream,counter)>>11)*(1.0/9007199254740991.0);
 }
 
 
@@ -41,8 +205,13 @@ int section_add(const char *name) {
 }
 
 int section_start(const char *name) {
-	int i=section_indexOf(name);
-	if (i<0) i=section_add(name);
+	int i;
+	//sections are started from concurrent tasks
+	#pragma omp critical(sections)
+	{
+		i=section_indexOf(name);
+		if (i<0) i=section_add(name);
+	}
 	struct section *s=&sections[i];
 	s->start=now();
 	return i;
@@ -59,6 +228,11 @@ void section_end(int i) {
 	s->count_iteration++;
 }
 
+void section_next_iteration(int i) {
+	sections[i].count_iteration=0;
+	sections[i].total_iteration=0;
+}
+
 void sections_next_iteration() {
 	for (int i=0;i<num_sections;i++) {
 		sections[i].count_iteration=0;
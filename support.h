@@ -3,6 +3,8 @@
 
 #include <assert.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
 
 #define MIN(x, y) (((x) < (y)) ? (x) : (y))
 #define MAX(x, y) (((x) > (y)) ? (x) : (y))
@@ -22,12 +24,72 @@ extern int num_sections;
 extern struct section sections[MAX_SECTIONS];
 
 int getenvl(const char* name, int def);
+double getenvd(const char* name, double def);
+int max_threads();
+int thread_num();
+int num_threads();
 void setup_devices();
 double now();
+int section_indexOf(const char *name);
 int section_start(const char *name);
 void section_end(int i);
+void section_next_iteration(int i);
 void sections_next_iteration();
 
+// hot-path counters of the work done, one row per thread so that counting
+// needs no atomics; rows are padded to a cache line
+enum counter {
+	COUNTER_COULOMB_PAIRS,
+	COUNTER_ENEMY_TESTS,         // relevant_enemy() tests
+	COUNTER_ENGAGEMENTS,         // attacker-defender interactions
+	COUNTER_FIGHTS,              // engagements within the fight radius
+	COUNTER_DESERTIONS,
+	COUNTER_ADD_CHILD_OVERFLOWS, // add_child() recursions into a full parent
+	COUNTER_DEVICE_BYTES_TO,     // copies to the offload target, see devicedata.h
+	COUNTER_DEVICE_BYTES_FROM,
+	COUNTER_KICKS,               // insects kicked, see block time steps in model.c
+	NUM_COUNTERS
+};
+#define COUNTER_ROW 16
+extern const char *counter_names[NUM_COUNTERS];
+extern long long *counter_rows;
+#define COUNT(c,n) (counter_rows[thread_num()*COUNTER_ROW+(c)]+=(n))
+void setup_counters();
+void counters_collect(long long *totals);
+
+// tracked allocations by subsystem, reported in log-memory.txt
+// each block carries its size and subsystem in a header in front of it, so
+// blocks from mem_malloc()/mem_calloc()/mem_realloc() go back with mem_free()
+enum mem_subsystem {
+	MEM_MODEL,                   // insects, actions, leaders, block steps, ensemble
+	MEM_FORCES,                  // coulomb and pm buffers, exchange between ranks
+	MEM_ENEMIES,                 // enemy lists, records and buckets, balance
+	MEM_ANALYSIS,                // analysis partials, log records, validation
+	MEM_FRAMES,                  // frame copies for the output tasks
+	MEM_IMAGES,                  // rendered images and png rows
+	MEM_OUTPUT,                  // output file buffers and requests
+	NUM_MEM_SUBSYSTEMS
+};
+extern const char *mem_subsystem_names[NUM_MEM_SUBSYSTEMS];
+void *mem_malloc(int subsystem, size_t size);
+void *mem_calloc(int subsystem, size_t n, size_t size);
+void *mem_realloc(int subsystem, void *p, size_t size);
+void mem_free(void *p);
+
+// the process-wide allocation state, the last entries are the totals
+struct mem_usage {
+	long long bytes[NUM_MEM_SUBSYSTEMS+1];     // currently allocated
+	long long peak[NUM_MEM_SUBSYSTEMS+1];      // largest bytes so far
+	long long allocs[NUM_MEM_SUBSYSTEMS+1];    // allocations since the last mem_collect()
+	long rss_kb, peak_rss_kb;
+};
+void mem_collect(struct mem_usage *u);
+
+// counter-based random numbers: the value only depends on (seed, stream, counter),
+// so any thread can draw the numbers of any stream without shared generator state
+uint64_t rng_hash(uint64_t seed, uint64_t stream, uint64_t counter);
+double rng_uniform01(uint64_t seed, uint64_t stream, uint64_t counter);
+
 #ifdef DEBUG
 #define printd(format,...) printf(format,__VA_ARGS__)
 #else
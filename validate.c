@@ -0,0 +1,326 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <float.h>
+
+#include "model.h"
+#include "support.h"
+#include "enemies.h"
+#include "analysis.h"
+#include "logging.h"
+#include "output.h"
+#include "validate.h"
+
+// state advanced by the reference implementation
+struct insect_data *ref_insects;
+struct leader_data *ref_leaders;
+struct insect_action_data *ref_actions;
+double ref_kinetic_energy, ref_potential_energy;
+
+// total forces and energies of the optimized step, collected by an analysis
+float *opt_fx, *opt_fy, *opt_fz;
+double opt_kinetic_energy, opt_potential_energy;
+double first_energy;
+int first_iteration=-1;
+
+struct validate_tolerances {
+	double force;                // max force deviation relative to the rms reference force
+	double position;             // max absolute position deviation
+	double velocity;             // max velocity deviation relative to the rms reference velocity
+	double mass;                 // max absolute mass deviation
+	int topology;                // number of insects allowed to differ in the tree
+	double energy;               // relative deviation of the total energy
+	double drift;                // relative change of the total energy since the first check, 0 for none
+} tol;
+
+FILE *fp_log_validate;
+
+//the original scalar enemy engagement: every follower engages all relevant
+//enemies by walking the tree
+void ref_attack_defend_fight(int attack, int defend) {
+	float dx,dy,dz,r,a,d;
+	
+	if (attack<0||defend<0||attack==defend) return;
+	dx=insects[defend].x-insects[attack].x;
+	dy=insects[defend].y-insects[attack].y;
+	dz=insects[defend].z-insects[attack].z;
+	r=sqrt(dx*dx+dy*dy+dz*dz);
+	float r0=params.attack_radius;
+	float rr=r;
+	if (rr<r0) rr=r0;
+	a = params.attack_constant/(rr*rr*rr);
+	d = params.defend_constant/(rr*rr*rr);
+	actions[attack].fx+=dx*a;
+	actions[attack].fy+=dy*a;
+	actions[attack].fz+=dz*a;
+	actions[defend].fx+=dx*d;
+	actions[defend].fy+=dy*d;
+	actions[defend].fz+=dz*d;
+	if (r<params.fight_radius) {
+		float md=insects[defend].m;
+		float ma=insects[attack].m;
+		float ratio=params.surrender_mass_ratio;
+		if (ma/md>ratio) {
+			//attack wins
+		} else 	if (md/ma>ratio) {
+			//defend wins
+			actions[attack].new_parent=defend;
+			float rm=.1/params.dt;
+			actions[attack].rm+=rm;
+			actions[defend].rm-=rm;
+		} else {
+			//mass transfer to heavier one
+			float rm=params.fight_mass_rate*(ma-md)/(ma+md);
+			actions[defend].rm-=rm;
+			actions[attack].rm+=rm;
+		}
+	}
+}
+
+void ref_engage_descendants(int target_idx, int insect_idx, int leader_idx) {
+	if (relevant_enemy(leader_idx,target_idx))
+		ref_attack_defend_fight(insect_idx,target_idx);
+	struct insect_data *target=&insects[target_idx];
+	for (int i=0;i<target->nchildren;i++)
+		ref_engage_descendants(target->children[i],insect_idx,leader_idx);
+}
+
+void ref_engage_enemies(int insect_idx) {
+	int leader_idx=insects[insect_idx].leader_idx;
+	if (leader_idx<0) return;
+	int node_idx=leader_idx;
+	int parent_idx=insects[leader_idx].parent;
+	while (parent_idx>=0) {
+		struct insect_data *parent=&insects[parent_idx];
+		//all peers of node are enenmies, i.e. all children of parent except node
+		for (int i=0;i<parent->nchildren;i++) {
+			int child_idx=parent->children[i];
+			if (child_idx!=node_idx)
+				ref_engage_descendants(child_idx,insect_idx,leader_idx);
+		}
+		node_idx=parent_idx;
+		parent_idx=parent->parent;
+	}
+}
+
+void ref_apply_velocities() {
+	float dt=params.dt;
+	for (int i=0;i<NumInsects;i++) {
+		insects[i].x+=insects[i].vx*dt;
+		insects[i].y+=insects[i].vy*dt;
+		insects[i].z+=insects[i].vz*dt;
+	}
+}
+
+void ref_calculate_forces() {
+	clear_actions(actions);
+	for (int i=0;i<NumInsects;i++) {
+		int parent=insects[i].parent;
+		tree_force(i, parent);
+	}
+	for (int i=0;i<NumInsects;i++) {
+		center_force(i);
+		coulomb_repell(i,actions);
+		ref_engage_enemies(i);
+	}
+}
+
+void ref_apply_forces() {
+	float dt=params.dt;
+	float beta=params.damping_constant;
+	for (int i=0;i<NumInsects;i++) {
+		insects[i].vx+=dt*(actions[i].fx/insects[i].m-insects[i].vx*beta);
+		insects[i].vy+=dt*(actions[i].fy/insects[i].m-insects[i].vy*beta);
+		insects[i].vz+=dt*(actions[i].fz/insects[i].m-insects[i].vz*beta);
+		insects[i].m +=dt*(actions[i].rm);
+		insects[i].m  =MAX(insects[i].m,params.mass_min);
+		int npar=actions[i].new_parent;
+		if (npar>=0) {
+			int par=insects[i].parent;
+			remove_child(par,i);
+			add_child(npar,i);
+		}
+	}
+}
+
+void ref_energies() {
+	double E=0, Ep=0;
+	for (int i=0;i<NumInsects;i++) {
+		struct insect_data *p=&insects[i];
+		E+=0.5*p->m*(p->vx*p->vx+p->vy*p->vy+p->vz*p->vz);
+		Ep+=actions[i].ep;
+	}
+	ref_kinetic_energy=E;
+	ref_potential_energy=Ep;
+}
+
+struct validate_partial {
+	double kinetic, potential;
+};
+
+void validate_visit(void *state, void *partial, const struct analysis_view *v) {
+	struct validate_partial *e=partial;
+	for (int i=v->begin;i<v->end;i++) {
+		const struct insect_data *p=&v->insects[i];
+		const struct insect_action_data *a=&v->actions[i];
+		const struct insect_action_data *ea=&v->enemy_actions[i];
+		const struct insect_action_data *sa=&v->slow_actions[i];
+		opt_fx[i]=a->fx+ea->fx+v->slow_weight*sa->fx;
+		opt_fy[i]=a->fy+ea->fy+v->slow_weight*sa->fy;
+		opt_fz[i]=a->fz+ea->fz+v->slow_weight*sa->fz;
+		e->kinetic+=0.5*p->m*(p->vx*p->vx+p->vy*p->vy+p->vz*p->vz);
+		e->potential+=a->ep+sa->ep;
+	}
+}
+
+void validate_end(void *state, int iteration, const void *partials, int num_blocks) {
+	const struct validate_partial *e=partials;
+	opt_kinetic_energy=0;
+	opt_potential_energy=0;
+	for (int b=0;b<num_blocks;b++) {
+		opt_kinetic_energy+=e[b].kinetic;
+		opt_potential_energy+=e[b].potential;
+	}
+}
+
+void setup_validation() {
+	ref_insects=mem_malloc(MEM_ANALYSIS,NumInsects*sizeof(struct insect_data));
+	ref_leaders=mem_malloc(MEM_ANALYSIS,MAX_NUM_LEADERS*sizeof(struct leader_data));
+	ref_actions=mem_malloc(MEM_ANALYSIS,NumInsects*sizeof(struct insect_action_data));
+	opt_fx=mem_malloc(MEM_ANALYSIS,NumInsects*sizeof(float));
+	opt_fy=mem_malloc(MEM_ANALYSIS,NumInsects*sizeof(float));
+	opt_fz=mem_malloc(MEM_ANALYSIS,NumInsects*sizeof(float));
+
+	tol.force=getenvd("VALIDATE_FORCE_TOL",1e-3);
+	tol.position=getenvd("VALIDATE_POSITION_TOL",1e-4);
+	tol.velocity=getenvd("VALIDATE_VELOCITY_TOL",1e-3);
+	tol.mass=getenvd("VALIDATE_MASS_TOL",1e-5);
+	tol.topology=getenvl("VALIDATE_TOPOLOGY_TOL",0);
+	tol.energy=getenvd("VALIDATE_ENERGY_TOL",1e-4);
+	tol.drift=getenvd("VALIDATE_DRIFT_TOL",0);
+
+	struct analysis a={0};
+	a.name="validate";
+	a.period=params.validate;
+	a.partial_size=sizeof(struct validate_partial);
+	a.visit_block=validate_visit;
+	a.end=validate_end;
+	analysis_register(&a);
+
+	char filename[4096];
+	sprintf(filename,"%s/log-validate.txt",params.output_dir);
+	fp_log_validate=output_fopen(filename);
+	fprintf(fp_log_validate,"# iteration force_max force_rms position_max position_rms velocity_max velocity_rms mass_max mass_rms topology_diffs energy_diff energy_drift\n");
+}
+
+void done_validation() {
+	fclose(fp_log_validate);
+}
+
+void validate_reference_step(int iteration) {
+	if (iteration%params.validate!=0) return;
+	memcpy(ref_insects,insects,NumInsects*sizeof(struct insect_data));
+	memcpy(ref_leaders,leaders,NumLeaders*sizeof(struct leader_data));
+	//the reference works on the model's globals, point them to the copy
+	struct insect_data *model_insects=insects;
+	struct leader_data *model_leaders=leaders;
+	struct insect_action_data *model_actions=actions;
+	insects=ref_insects;
+	leaders=ref_leaders;
+	actions=ref_actions;
+	FILE *journal=log_files.journal;
+	log_files.journal=NULL;
+	//the optimized iteration starts with the drift only at the first step,
+	//later on the drift to a step is part of the previous one
+	if (model_step==0)
+		ref_apply_velocities();
+	ref_calculate_forces();
+	ref_apply_forces();
+	ref_energies();
+	ref_apply_velocities();
+	insects=model_insects;
+	leaders=model_leaders;
+	actions=model_actions;
+	log_files.journal=journal;
+	//the reference's tree changes are not the model's work
+	long long counts[NUM_COUNTERS];
+	counters_collect(counts);
+}
+
+struct deviation {
+	double max, sum2, ref2;
+	long n;
+};
+
+void deviation_add(struct deviation *d, double opt, double ref) {
+	double e=fabs(opt-ref);
+	d->max=MAX(d->max,e);
+	d->sum2+=e*e;
+	d->ref2+=ref*ref;
+	d->n++;
+}
+
+double deviation_rms(struct deviation *d) {
+	return d->n ? sqrt(d->sum2/d->n) : 0;
+}
+
+double deviation_ref_rms(struct deviation *d) {
+	return d->n ? sqrt(d->ref2/d->n) : 0;
+}
+
+void validate_compare(int iteration) {
+	if (iteration%params.validate!=0) return;
+	struct deviation force={0}, position={0}, velocity={0}, mass={0};
+	int topology=0;
+	for (int i=0;i<NumInsects;i++) {
+		struct insect_data *p=&insects[i];
+		struct insect_data *r=&ref_insects[i];
+		deviation_add(&force,opt_fx[i],ref_actions[i].fx);
+		deviation_add(&force,opt_fy[i],ref_actions[i].fy);
+		deviation_add(&force,opt_fz[i],ref_actions[i].fz);
+		deviation_add(&position,p->x,r->x);
+		deviation_add(&position,p->y,r->y);
+		deviation_add(&position,p->z,r->z);
+		deviation_add(&velocity,p->vx,r->vx);
+		deviation_add(&velocity,p->vy,r->vy);
+		deviation_add(&velocity,p->vz,r->vz);
+		deviation_add(&mass,p->m,r->m);
+		int same=p->parent==r->parent && p->leader_id==r->leader_id && p->leader_idx==r->leader_idx
+			&& p->nchildren==r->nchildren
+			&& memcmp(p->children,r->children,p->nchildren*sizeof(int))==0;
+		topology+=!same;
+	}
+	for (int k=0;k<NumLeaders;k++)
+		topology+=(leaders[k].insect_idx!=ref_leaders[k].insect_idx);
+
+	double fref=MAX(deviation_ref_rms(&force),FLT_MIN);
+	double vref=MAX(deviation_ref_rms(&velocity),FLT_MIN);
+	double E=opt_kinetic_energy+opt_potential_energy;
+	double Eref=ref_kinetic_energy+ref_potential_energy;
+	double energy=fabs(E-Eref)/MAX(fabs(Eref),DBL_MIN);
+	if (first_iteration<0) {
+		first_iteration=iteration;
+		first_energy=Eref;
+	}
+	double drift=(E-first_energy)/MAX(fabs(first_energy),DBL_MIN);
+	fprintf(fp_log_validate,"%4d %e %e %e %e %e %e %e %e %d %e %e\n",iteration,
+		force.max/fref,deviation_rms(&force)/fref,
+		position.max,deviation_rms(&position),
+		velocity.max/vref,deviation_rms(&velocity)/vref,
+		mass.max,deviation_rms(&mass),
+		topology,energy,drift);
+	fflush(fp_log_validate);
+
+	int failed=0;
+	if (force.max/fref>tol.force) {printf("validation: force deviation %e > %e\n",force.max/fref,tol.force); failed=1;}
+	if (position.max>tol.position) {printf("validation: position deviation %e > %e\n",position.max,tol.position); failed=1;}
+	if (velocity.max/vref>tol.velocity) {printf("validation: velocity deviation %e > %e\n",velocity.max/vref,tol.velocity); failed=1;}
+	if (mass.max>tol.mass) {printf("validation: mass deviation %e > %e\n",mass.max,tol.mass); failed=1;}
+	if (topology>tol.topology) {printf("validation: %d insects differ in the tree\n",topology); failed=1;}
+	if (energy>tol.energy) {printf("validation: energy deviation %e > %e\n",energy,tol.energy); failed=1;}
+	if (tol.drift>0 && fabs(drift)>tol.drift) {printf("validation: energy drift %e > %e\n",drift,tol.drift); failed=1;}
+	if (failed) {
+		printf("validation failed at iteration %d\n",iteration);
+		exit(-1);
+	}
+}
@@ -0,0 +1,16 @@
+#ifndef VALIDATE_H
+#define VALIDATE_H
+
+// validation of the optimized model against the reference implementation
+// the reference is the original scalar force and integration code. It
+// advances a copy of the state the optimized iteration starts from, and the
+// results of both are compared: forces, positions, velocities, masses, tree
+// topology and energy. Tolerances are set with the environment, see
+// setup_validation(); the run stops with an error when one is exceeded.
+
+void setup_validation();
+void validate_reference_step(int iteration);
+void validate_compare(int iteration);
+void done_validation();
+
+#endif
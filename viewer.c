@@ -0,0 +1,61 @@
+#define _DEFAULT_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "support.h"
+#include "model.h"
+#include "render.h"
+#include "shmframes.h"
+#include "output.h"
+
+// renders the frames published by the simulation through FRAME_SHM
+// always takes the latest frame and skips the ones it is too slow for
+
+int main(int argc, char **argv)
+{
+	if (argc<2) {
+		printf("usage: %s <shared memory name> [output dir]\n",argv[0]);
+		exit(-1);
+	}
+	const char *output_dir=argc>2 ? argv[2] : "out";
+	int poll_us=getenvl("VIEWER_POLL_US",10000);
+	float scale=getenvd("RENDER_SCALE",1);
+
+	setup_output();
+	struct shm_frames s;
+	while (shm_frames_attach(&s,argv[1])!=0)
+		usleep(poll_us);
+	printf("attached to run %016llx\n",(unsigned long long)s.header->run_id);
+
+	int last=-1, rendered=0, torn=0;
+	for (;;) {
+		int finished=__atomic_load_n(&s.header->finished,__ATOMIC_ACQUIRE);
+		struct frame f;
+		uint64_t seq=shm_frames_latest(&s,&f);
+		if (seq && f.iteration!=last) {
+			struct image *img=render_frame(&f,scale);
+			if (shm_frames_valid(&s,&f,seq)) {
+				char filename[1024];
+				sprintf(filename,"%s/iteration.%04d.png",output_dir,f.iteration);
+				writeImage(filename,img,"");
+				last=f.iteration;
+				rendered++;
+			} else {
+				//the simulation overwrote the slot while we were drawing it
+				torn++;
+			}
+			destroyImage(img);
+		} else if (finished) {
+			break;
+		} else if (!shm_frames_producer_alive(&s)) {
+			printf("the simulation ended without finishing the frames\n");
+			break;
+		} else {
+			usleep(poll_us);
+		}
+	}
+	done_output();
+	printf("rendered %d frames, %d torn frames dropped, last iteration %d\n",rendered,torn,last);
+	return 0;
+}
@@ -6,6 +6,7 @@
 
 #include "support.h"
 #include "writepng.h"
+#include "output.h"
 
 struct rgb hsv2rgb(struct hsv in)
 {
@@ -94,25 +95,43 @@ void normalizeImage(struct image* img) {
 	}
 }
 
+void write_png_data(png_structp png_ptr, png_bytep data, png_size_t length) {
+	output_write(png_get_io_ptr(png_ptr),data,length);
+}
+
+void flush_png_data(png_structp png_ptr) {
+	output_flush(png_get_io_ptr(png_ptr));
+}
+
+// libpng's own allocations, the zlib state among them, count as images
+png_voidp malloc_png(png_structp png_ptr, png_alloc_size_t size) {
+	return mem_malloc(MEM_IMAGES,size);
+}
+
+void free_png(png_structp png_ptr, png_voidp p) {
+	mem_free(p);
+}
+
 int writeImage(const char* filename, const struct image* img, const char* title)
 {
 	int width=img->width;
 	int height=img->height;
 	struct rgb* buffer=img->buffer;
 	int retval = 0;
-	FILE *fp = NULL;
+	struct output_file *fp = NULL;
 	png_structp png_ptr = NULL;
 	png_infop info_ptr = NULL;
 	png_bytep row = NULL;
 	
-	fp = fopen(filename, "wb");
+	fp = output_open(filename);
 	if (fp == NULL) {
 		fprintf(stderr, "Could not open file %s for writing\n", filename);
 		retval = 1;
 		goto abort;
 	}
 
-	png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+	png_ptr = png_create_write_struct_2(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL,
+			NULL, malloc_png, free_png);
 	if (png_ptr == NULL) {
 		fprintf(stderr, "Could not allocate write struct\n");
 		retval = 1;
@@ -132,7 +151,7 @@ int writeImage(const char* filename, const struct image* img, const char* title)
 		goto abort;
 	}
 
-	png_init_io(png_ptr, fp);
+	png_set_write_fn(png_ptr, fp, write_png_data, flush_png_data);
 
 	png_set_IHDR(png_ptr, info_ptr, width, height,
 			8, PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE,
@@ -148,7 +167,7 @@ int writeImage(const char* filename, const struct image* img, const char* title)
 
 	png_write_info(png_ptr, info_ptr);
 
-	row = (png_bytep) malloc(3 * width * sizeof(png_byte));
+	row = (png_bytep) mem_malloc(MEM_IMAGES,3 * width * sizeof(png_byte));
 
 	int x, y;
 	for (y=0 ; y<height ; y++) {
@@ -161,10 +180,10 @@ int writeImage(const char* filename, const struct image* img, const char* title)
 	png_write_end(png_ptr, NULL);
 
 abort:
-	if (fp != NULL) fclose(fp);
+	if (fp != NULL) output_close(fp);
 	if (info_ptr != NULL) png_free_data(png_ptr, info_ptr, PNG_FREE_ALL, -1);
-	if (png_ptr != NULL) png_destroy_write_struct(&png_ptr, (png_infopp)NULL);
-	if (row != NULL) free(row);
+	if (png_ptr != NULL) png_destroy_write_struct(&png_ptr, info_ptr != NULL ? &info_ptr : (png_infopp)NULL);
+	if (row != NULL) mem_free(row);
 
 	return retval;
 }